@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -16,42 +16,289 @@
 
 #include "types.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "fsstat.h"
+
+// Buffers are found through a hash table keyed by (dev, blockno).
+// Each bucket has its own spinlock, which protects the bucket's
+// chain and the refcnt of every buffer on it, so lookups of
+// different blocks proceed in parallel.
+//
+// Recycling a buffer for a new block takes bcache.lock, which
+// serializes misses and owns the clock hand.
+//
+// Replacement is a clock version of 2Q, so that one long
+// sequential read can't push everything else out.  A block
+// starts out cold, and cold buffers are recycled in FIFO order
+// when the hand reaches them, however often they were used in
+// between.  Evicted cold blocks are remembered in a ghost table;
+// a miss on one of those shows the block is re-read over a longer
+// span, and it comes back hot.  Blocks in the metadata range
+// (inodes and bitmap) are always hot.  Hot buffers get a second
+// chance from the used bit, and are only evicted ahead of cold
+// ones while they make up more than MAXHOT of the cache.
+//
+// Block data is carved out of kalloc'd pages, BPERPAGE blocks
+// to a page.  The buf structs live apart from the data, GPAGES
+// pages' worth of them in a group at the start of a page of
+// their own, so that data pages hold nothing else.  The groups
+// are on bcache.groups.  The cache grows a data page at a time
+// while it is smaller than 1/BCACHEFRAC of RAM, and kalloc()
+// calls breclaim() to take idle pages back when memory runs
+// out.  It never shrinks below NBUF buffers.  Buffers that hold
+// no block yet are on bcache.free, with dev 0.
+//
+// Lock order: bcache.lock, then a bucket lock.
+
+#define NBUCKET 1021
+#define BHASH(dev, blockno) ((((dev)<<16) ^ (blockno)) % NBUCKET)
+#define BPERPAGE (PGSIZE / BSIZE)
+#define GPAGES ((PGSIZE - 64) / (BPERPAGE*sizeof(struct buf) + sizeof(uchar*)))
+#define RECLAIMBATCH 16  // pages breclaim() tries to free per call
+#define NGHOST 1021      // ghost table entries
+#define GHOSTKEY(dev, blockno) (((uint64)(dev)<<32) | (blockno))
+#define MAXHOT(nbuf) ((nbuf) - (nbuf)/4)  // most hot buffers
+
+extern char end[]; // first address after kernel.
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;
+};
+
+// The buffers of up to GPAGES data pages.
+struct bufgroup {
+  struct bufgroup *next;  // bcache.groups
+  int npages;             // data pages in use
+  uchar *page[GPAGES];    // data pages, or 0
+  struct buf buf[GPAGES*BPERPAGE];  // buf[i] is in page[i/BPERPAGE]
+};
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *hand;    // ring of all buffers, through prev/next
+  struct buf *free;    // buffers holding no block, through hnext
+  struct bufgroup *groups;
+  int nbuf;
+  int maxbuf;
+  int nhot;            // buffers in the protected set
+  int nwait;           // processes waiting in bget for a buffer
+  uint metadev;        // blocks [metastart, metaend) of metadev
+  uint metastart;      //   are always hot
+  uint metaend;
+  struct bucket bucket[NBUCKET];
+  uint64 ghost[NGHOST]; // recently evicted cold blocks, GHOSTKEY+1
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  uint64 hits;
+  uint64 misses;
+  uint64 evictions;
+  uint64 reclaimed;
 } bcache;
 
+// Is there a group with room for another data page?
+// Caller must hold bcache.lock.
+static int
+broom(void)
+{
+  struct bufgroup *g;
+
+  for(g = bcache.groups; g; g = g->next)
+    if(g->npages < GPAGES)
+      return 1;
+  return 0;
+}
+
+// Add data page pa to the cache, putting its buffers on the
+// ring and the free list.  They go in a group with room, or
+// else in g, a fresh page, which is freed if it isn't needed.
+// If there is no room and no g, frees pa and returns 0.
+// Caller must hold bcache.lock.
+static int
+baddpage(uchar *pa, struct bufgroup *g)
+{
+  struct bufgroup *gp;
+  struct buf *b;
+  int i, j;
+
+  for(gp = bcache.groups; gp; gp = gp->next)
+    if(gp->npages < GPAGES)
+      break;
+  if(gp == 0){
+    if(g == 0){
+      kfree(pa);
+      return 0;
+    }
+    memset(g, 0, sizeof(*g));
+    g->next = bcache.groups;
+    bcache.groups = g;
+    gp = g;
+  } else if(g){
+    kfree(g);
+  }
+
+  for(j = 0; gp->page[j]; j++)
+    ;
+  gp->page[j] = pa;
+  gp->npages++;
+  for(i = 0; i < BPERPAGE; i++){
+    b = &gp->buf[j*BPERPAGE + i];
+    memset(b, 0, sizeof(*b));
+    b->data = pa + i*BSIZE;
+    initsleeplock(&b->lock, "buffer");
+    if(bcache.hand == 0){
+      b->next = b->prev = b;
+      bcache.hand = b;
+    } else {
+      // Just behind the hand, so the clock reaches it last.
+      b->next = bcache.hand;
+      b->prev = bcache.hand->prev;
+      b->prev->next = b;
+      b->next->prev = b;
+    }
+    b->hnext = bcache.free;
+    bcache.free = b;
+  }
+  bcache.nbuf += BPERPAGE;
+  return 1;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
+  void *pa, *g;
+
+  if(sizeof(struct bufgroup) > PGSIZE)
+    panic("binit: bufgroup");
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  bcache.maxbuf = (PHYSTOP - (uint64)end) / PGSIZE / BCACHEFRAC * BPERPAGE;
+  if(bcache.maxbuf < NBUF)
+    bcache.maxbuf = NBUF;
+
+  while(bcache.nbuf < NBUF){
+    if((pa = kalloc()) == 0 || (g = kalloc()) == 0)
+      panic("binit");
+    acquire(&bcache.lock);
+    baddpage(pa, g);
+    release(&bcache.lock);
   }
 }
 
+// Look for block on device dev in bucket bk, whose lock must be held.
+// If found, take a reference to it.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Remove b from the chain of bucket bk, whose lock must be held.
+static void
+bunhash(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != b; pp = &(*pp)->hnext)
+    ;
+  *pp = b->hnext;
+}
+
+// Find an unreferenced buffer to recycle, remove it from
+// its hash chain, and return it with refcnt 1.
+// Caller must hold bcache.lock.
+static struct buf*
+bvictim(void)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int i;
+
+  if((b = bcache.free) != 0){
+    bcache.free = b->hnext;
+    b->refcnt = 1;
+    return b;
+  }
+
+  // Two full turns may only clear used bits of hot buffers
+  // that are all within MAXHOT; the third takes anything idle.
+  for(i = 0; i < 3*bcache.nbuf; i++){
+    b = bcache.hand;
+    bcache.hand = b->next;
+
+    bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+    acquire(&bk->lock);
+    if(b->refcnt == 0){
+      if(b->hot && b->used && i < 2*bcache.nbuf){
+        b->used = 0;
+      } else if(!b->hot || bcache.nhot > MAXHOT(bcache.nbuf) ||
+                i >= 2*bcache.nbuf){
+        bunhash(bk, b);
+        b->refcnt = 1;
+        release(&bk->lock);
+        if(b->hot){
+          b->hot = 0;
+          bcache.nhot--;
+        } else {
+          bcache.ghost[GHOSTKEY(b->dev, b->blockno) % NGHOST] =
+            GHOSTKEY(b->dev, b->blockno) + 1;
+        }
+        __sync_fetch_and_add(&bcache.evictions, 1);
+        return b;
+      }
+    }
+    release(&bk->lock);
+  }
+  return 0;
+}
+
+// Should a block that just missed start out hot?
+// Caller must hold bcache.lock.
+static int
+bhot(uint dev, uint blockno)
+{
+  uint64 *g;
+
+  if(dev == bcache.metadev && blockno >= bcache.metastart &&
+     blockno < bcache.metaend)
+    return 1;
+  g = &bcache.ghost[GHOSTKEY(dev, blockno) % NGHOST];
+  if(*g == GHOSTKEY(dev, blockno) + 1){
+    *g = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// Tell the cache that blocks [start, end) of dev hold
+// metadata, which should be kept in preference to data.
+void
+bsetmeta(uint dev, uint start, uint end)
+{
+  acquire(&bcache.lock);
+  bcache.metadev = dev;
+  bcache.metastart = start;
+  bcache.metaend = end;
+  release(&bcache.lock);
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
@@ -59,33 +306,75 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk;
+  void *pa, *g;
+  int room;
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[BHASH(dev, blockno)];
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    __sync_fetch_and_add(&bcache.hits, 1);
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Not cached.  Check again under bcache.lock, since
+  // another process may have recycled a buffer for
+  // this block after we looked.
+  acquire(&bcache.lock);
+  for(;;){
+    acquire(&bk->lock);
+    b = bfind(bk, dev, blockno);
+    release(&bk->lock);
+    if(b){
+      __sync_fetch_and_add(&bcache.hits, 1);
+      break;
+    }
+
+    // Grow rather than evict while below the limit.
+    // kalloc() may call breclaim(), so drop the lock.
+    if(bcache.free == 0 && bcache.nbuf < bcache.maxbuf){
+      room = broom();
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      pa = kalloc();
+      g = pa && !room ? kalloc() : 0;
+      acquire(&bcache.lock);
+      if(pa && baddpage(pa, g))
+        continue;
     }
-  }
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
+    // Count ourselves as waiting before looking, so that a
+    // brelse of a buffer bvictim() has passed wakes us up.
+    bcache.nwait++;
+    b = bvictim();
+    if(b){
+      bcache.nwait--;
+      __sync_fetch_and_add(&bcache.misses, 1);
       b->dev = dev;
       b->blockno = blockno;
       b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      b->used = 0;
+      if((b->hot = bhot(dev, blockno)) != 0)
+        bcache.nhot++;
+      acquire(&bk->lock);
+      b->hnext = bk->head;
+      bk->head = b;
+      release(&bk->lock);
+      break;
     }
+
+    // Every buffer is in use and memory is short;
+    // wait for a brelse.
+    sleep(&bcache, &bcache.lock);
+    bcache.nwait--;
   }
-  panic("bget: no buffers");
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -96,7 +385,7 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    blkrw(b, 0);
     b->valid = 1;
   }
   return b;
@@ -108,11 +397,74 @@ bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  blkrw(b, 1);
+}
+
+// Like bwrite, but poll the disk rather than sleep until
+// the write is done.  For short writes that a commit waits
+// for, like the log header.
+void
+bwritepoll(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwritepoll");
+  blkrwpoll(b, 1);
+}
+
+// Start writing b's contents to disk, without waiting.
+// b must be locked, and stay locked until bwait(b).
+void
+bwritestart(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwritestart");
+  blksubmit(b, 1, 0);
+}
+
+// Start writing b's contents to disk block blockno instead
+// of its own, without waiting.  b must be locked, and stay
+// locked until bwait(b).
+void
+bwriteto(struct buf *b, uint blockno)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwriteto");
+  blksubmitat(b, blockno, 1, 0);
+}
+
+// Wait for a write started by bwritestart() or bwriteto() to finish.
+void
+bwait(struct buf *b)
+{
+  blkwait(b);
+}
+
+// Drop a reference to b.  Wake up bget if it is waiting for
+// a buffer to become free.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk;
+  int wake;
+
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
+  b->refcnt--;
+  wake = 0;
+  if(b->refcnt == 0){
+    b->used = 1;
+    wake = bcache.nwait;
+  }
+  release(&bk->lock);
+
+  if(wake){
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
+  }
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +472,199 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  bput(b);
+}
+
+// Called from the disk interrupt when a read started by
+// breadahead(), or a write started by bwriterelse(), finishes.
+static void
+biodone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// Start writing b's contents to disk, and give b up: it is
+// released when the write has finished.  b must be locked.
+void
+bwriterelse(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwriterelse");
+  blksubmit(b, 1, biodone);
 }
 
+// Start reading the indicated block into the cache, if it
+// is not there already, without waiting for the data.
+// The buffer stays locked until biodone().
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  // Cached, or being read: nothing to do.
+  bk = &bcache.bucket[BHASH(dev, blockno)];
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  if(b)
+    return;
+
+  b = bget(dev, blockno);
+  if(b->valid){
+    brelse(b);
+    return;
+  }
+  blksubmit(b, 0, biodone);
+}
+
+// Try to free data page j of group g.  Each of its buffers
+// that is idle is dropped from the cache; if one is in use,
+// the others go on the free list instead.
+// Caller must hold bcache.lock.
+static int
+bfreepage(struct bufgroup *g, int j)
+{
+  struct buf *pg, *x, **pp;
+  struct bucket *bk;
+  int i, busy;
+
+  pg = &g->buf[j*BPERPAGE];
+
+  // Take the page's buffers off the free list and hash chains.
+  busy = 0;
+  for(pp = &bcache.free; *pp; ){
+    if(*pp >= pg && *pp < pg + BPERPAGE)
+      *pp = (*pp)->hnext;
+    else
+      pp = &(*pp)->hnext;
+  }
+  for(i = 0; i < BPERPAGE; i++){
+    x = pg + i;
+    if(x->dev == 0)
+      continue;
+    bk = &bcache.bucket[BHASH(x->dev, x->blockno)];
+    acquire(&bk->lock);
+    if(x->refcnt == 0){
+      bunhash(bk, x);
+      x->dev = 0;
+      if(x->hot){
+        x->hot = 0;
+        bcache.nhot--;
+      }
+    } else {
+      busy = 1;
+    }
+    release(&bk->lock);
+  }
+
+  if(busy){
+    for(i = 0; i < BPERPAGE; i++){
+      x = pg + i;
+      if(x->dev == 0){
+        x->hnext = bcache.free;
+        bcache.free = x;
+      }
+    }
+    return 0;
+  }
 
+  for(i = 0; i < BPERPAGE; i++){
+    x = pg + i;
+    if(bcache.hand == x)
+      bcache.hand = x->next;
+    x->prev->next = x->next;
+    x->next->prev = x->prev;
+  }
+  bcache.nbuf -= BPERPAGE;
+  kfree(g->page[j]);
+  g->page[j] = 0;
+  g->npages--;
+  return 1;
+}
+
+// Does data page j of group g hold a hot buffer?
+static int
+bpagehot(struct bufgroup *g, int j)
+{
+  int i;
+
+  for(i = 0; i < BPERPAGE; i++)
+    if(g->buf[j*BPERPAGE + i].hot)
+      return 1;
+  return 0;
+}
+
+// Give idle buffer pages back to the page allocator.
+// Called by kalloc() when it runs out of memory, perhaps
+// with other spinlocks held, so it never waits for bcache.lock.
+// Returns the number of pages freed.
+int
+breclaim(void)
+{
+  struct bufgroup *g, **pp;
+  int j, n, npages, pass;
+
+  if(!tryacquire(&bcache.lock))
+    return 0;
+
+  // Pages with hot buffers are spared unless nothing else
+  // can be freed.  A group's own page goes once it has no
+  // data pages left.
+  n = npages = 0;
+  for(pass = 0; pass < 2 && n == 0; pass++){
+    for(pp = &bcache.groups; (g = *pp) != 0; ){
+      for(j = 0; j < GPAGES; j++){
+        if(n >= RECLAIMBATCH || bcache.nbuf - BPERPAGE < NBUF)
+          break;
+        if(g->page[j] && (pass > 0 || !bpagehot(g, j)) && bfreepage(g, j))
+          n++;
+      }
+      if(g->npages == 0){
+        *pp = g->next;
+        kfree(g);
+        npages++;
+      } else {
+        pp = &g->next;
+      }
+      if(j < GPAGES)
+        break;
+    }
+  }
+  bcache.reclaimed += n * BPERPAGE;
+  release(&bcache.lock);
+  return n + npages;
+}
+
+// Copy the cache's counters to *st.
+void
+bstat(struct bcachestat *st)
+{
+  acquire(&bcache.lock);
+  st->hits = bcache.hits;
+  st->misses = bcache.misses;
+  st->evictions = bcache.evictions;
+  st->reclaimed = bcache.reclaimed;
+  st->nbuf = bcache.nbuf;
+  st->maxbuf = bcache.maxbuf;
+  st->nhot = bcache.nhot;
+  release(&bcache.lock);
+}
@@ -0,0 +1,248 @@
+// Block I/O queue.
+//
+// Sits between the buffer cache and the disk driver.  Requests
+// wait in a queue sorted by block number, and are sent to the
+// disk in elevator (C-SCAN) order: upward from the block after
+// the last one sent, then around again from the lowest.  A run
+// of queued buffers for consecutive blocks, all reads or all
+// writes, goes to the disk as a single scatter-gather request.
+//
+// There is a queue, with its own lock and elevator, for each
+// of the disk's request queues.  A request goes on the queue
+// of the hart that submits it, and is sent to the matching
+// disk queue, so harts doing I/O at the same time don't
+// share a lock.  Completions come back on the same queue.
+//
+// Requests normally go to the disk at once if it has room.
+// A process that is about to start a batch of I/O can call
+// blkplug() first, and blkunplug() afterwards; requests it
+// starts in between wait in the queue, so that they can be
+// sorted and merged.  Waiting for any request sends the queue
+// to the disk, so a plugged process cannot wait forever.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+
+#define POLLTIME (CLINT_FREQ / 10000)  // blkrwpoll() spins 100us at most
+
+struct blkq {
+  struct spinlock lock;
+  struct buf *queue;  // waiting requests, sorted by qblock, through qnext
+  uint pos;           // where the elevator is
+} blkq[NCPU];
+
+void
+blkinit(void)
+{
+  struct blkq *q;
+
+  for(q = blkq; q < blkq + NCPU; q++)
+    initlock(&q->lock, "blkq");
+}
+
+// The queue for this hart's requests.
+static struct blkq*
+myqueue(void)
+{
+  int qi;
+
+  push_off();
+  qi = cpuid() % virtio_disk_nqueue();
+  pop_off();
+  return &blkq[qi];
+}
+
+static void blkdone(struct buf *);
+
+// Send as many of q's requests as the disk will take.
+// Caller must hold q->lock.
+static void
+blkdispatch(struct blkq *q)
+{
+  struct buf *b, *prev, *last, *before, *next;
+  int n;
+
+  while(q->queue){
+    // Find the first request at or beyond the elevator.
+    prev = 0;
+    for(b = q->queue; b && b->qblock < q->pos; b = b->qnext)
+      prev = b;
+    if(b == 0){
+      prev = 0;
+      b = q->queue;
+    }
+    before = prev;
+
+    // Extend it with requests for the following blocks.
+    last = b;
+    for(n = 1; n < MAXMERGE; n++){
+      if(last->qnext == 0 || last->qnext->qwrite != b->qwrite ||
+         last->qnext->qblock != last->qblock + 1)
+        break;
+      last = last->qnext;
+    }
+
+    // Take the run out of the queue first, since the disk
+    // may finish it, and chain other requests after it,
+    // before virtio_disk_submit() returns.
+    next = last->qnext;
+    last->qnext = 0;
+    if(virtio_disk_submit(q - blkq, b, n, b->qwrite, blkdone) < 0){
+      last->qnext = next;
+      break;
+    }
+    if(before)
+      before->qnext = next;
+    else
+      q->queue = next;
+    q->pos = last->qblock + 1;
+  }
+}
+
+// Called by the disk driver, with no locks held, when the
+// request starting with buffer b has finished.  The buffers
+// of it and of any other finished requests are chained from
+// b through qnext.
+static void
+blkdone(struct buf *b)
+{
+  struct buf *next, *async;
+  struct blkq *q = &blkq[b->qi];
+
+  acquire(&q->lock);
+  async = 0;
+  for(; b; b = next){
+    next = b->qnext;
+    b->disk = 0;
+    if(b->done){
+      b->qnext = async;
+      async = b;
+    } else {
+      b->qnext = 0;
+      wakeup(b);
+    }
+  }
+  // The disk has room again.
+  blkdispatch(q);
+  release(&q->lock);
+
+  // Buffers with a done function belong to nobody else
+  // until it has been called.
+  for(b = async; b; b = next){
+    next = b->qnext;
+    b->qnext = 0;
+    b->done(b);
+  }
+}
+
+// Start reading or writing locked buffer b.  If done is non-zero,
+// it is called with b, in interrupt context, when the I/O has
+// finished; otherwise the caller must blkwait(b).
+void
+blksubmit(struct buf *b, int write, void (*done)(struct buf *))
+{
+  blksubmitat(b, b->blockno, write, done);
+}
+
+// Like blksubmit(), but to or from disk block blockno
+// rather than the one b caches.
+void
+blksubmitat(struct buf *b, uint blockno, int write, void (*done)(struct buf *))
+{
+  struct buf **pp;
+  struct proc *p = myproc();
+  struct blkq *q = myqueue();
+
+  acquire(&q->lock);
+  b->disk = 1;
+  b->qwrite = write;
+  b->qblock = blockno;
+  b->qi = q - blkq;
+  b->done = done;
+  for(pp = &q->queue; *pp && (*pp)->qblock < blockno; pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
+  if(p == 0 || p->blkplug == 0)
+    blkdispatch(q);
+  release(&q->lock);
+}
+
+// Wait for I/O started by blksubmit(b, write, 0).
+void
+blkwait(struct buf *b)
+{
+  struct blkq *q = &blkq[b->qi];
+
+  acquire(&q->lock);
+  blkdispatch(q);
+  while(b->disk)
+    sleep(b, &q->lock);
+  release(&q->lock);
+}
+
+// Read or write b, and wait for it.
+void
+blkrw(struct buf *b, int write)
+{
+  blksubmit(b, write, 0);
+  blkwait(b);
+}
+
+// Read or write b, spinning on the disk's completions for
+// a while instead of sleeping until the interrupt.  Saves a
+// trip through the interrupt handler and the scheduler when
+// a short, latency-critical request is all the caller has
+// to wait for.
+void
+blkrwpoll(struct buf *b, int write)
+{
+  struct blkq *q;
+  uint64 deadline;
+
+  blksubmit(b, write, 0);
+  q = &blkq[b->qi];
+  acquire(&q->lock);
+  blkdispatch(q);
+  release(&q->lock);
+
+  deadline = readmtime() + POLLTIME;
+  while(*(volatile int *)&b->disk && readmtime() < deadline)
+    virtio_disk_poll(b->qi);
+  blkwait(b);
+}
+
+// Hold back the calling process's requests until blkunplug().
+// Calls nest.
+void
+blkplug(void)
+{
+  myproc()->blkplug++;
+}
+
+// The process may have moved between harts while plugged,
+// leaving requests on more than one queue, so send them all.
+void
+blkunplug(void)
+{
+  struct proc *p = myproc();
+  struct blkq *q;
+
+  if(p->blkplug < 1)
+    panic("blkunplug");
+  if(--p->blkplug == 0){
+    for(q = blkq; q < blkq + virtio_disk_nqueue(); q++){
+      acquire(&q->lock);
+      blkdispatch(q);
+      release(&q->lock);
+    }
+  }
+}
@@ -4,9 +4,18 @@ struct buf {
   uint dev;
   uint blockno;
   struct sleeplock lock;
-  uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint refcnt; // protected by the lock of b's hash bucket
+  int used;    // referenced since the clock hand last passed?
+  int hot;     // in the protected set? (bcache.lock)
+  uint lseq;   // last log transaction to include this block
+  struct buf *prev; // clock ring of all buffers
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *hnext; // hash bucket chain, or free list
+  struct buf *qnext; // block I/O queue, or disk request
+  int qwrite;  // queued for writing, not reading
+  int qi;      // the queue its I/O is on
+  uint qblock; // disk block the queued I/O is for
+  void (*done)(struct buf *); // called when queued I/O finishes
+  uchar *data; // BSIZE bytes, in one of the cache's data pages
 };
 
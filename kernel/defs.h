@@ -1,21 +1,43 @@
+struct bcachestat;
 struct buf;
 struct context;
 struct file;
 struct inode;
+struct logstat;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
+struct tms;
 struct superblock;
 
+// blk.c
+void            blkinit(void);
+void            blksubmit(struct buf*, int, void (*)(struct buf *));
+void            blksubmitat(struct buf*, uint, int, void (*)(struct buf *));
+void            blkwait(struct buf*);
+void            blkrw(struct buf*, int);
+void            blkrwpoll(struct buf*, int);
+void            blkplug(void);
+void            blkunplug(void);
+
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritepoll(struct buf*);
+void            bsetmeta(uint, uint, uint);
+void            bwritestart(struct buf*);
+void            bwriteto(struct buf*, uint);
+void            bwriterelse(struct buf*);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             breclaim(void);
+void            breadahead(uint, uint);
+void            bstat(struct bcachestat*);
 
 // console.c
 void            consoleinit(void);
@@ -41,12 +63,14 @@ struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
+int             ireclaim(void);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
+void            dcset(struct inode*, char*, uint);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
@@ -71,6 +95,13 @@ void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            begin_dataop(void);
+void            end_dataop(void);
+void            log_sync(void);
+void            log_data(struct buf*);
+void            log_free(uint, int);
+int             log_freed(uint);
+void            logstat(struct logstat*);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -88,10 +119,11 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
-void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             setaffinity(int, uint64);
+uint64          getaffinity(int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -102,12 +134,14 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
-int             wait(uint64);
+void            kthread(void (*)(void), char*);
+int             wait(int, uint64, int);
 void            wakeup(void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+void            proctimes(struct tms*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -117,6 +151,7 @@ void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
+int             tryacquire(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
@@ -149,6 +184,7 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+uint64          readmtime(void);
 int             is_cowpage(pagetable_t, uint64);
 void*           cow_alloc(pagetable_t, uint64);
 
@@ -186,8 +222,10 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_nqueue(void);
+int             virtio_disk_submit(int, struct buf *, int, int, void (*)(struct buf *));
 void            virtio_disk_intr(void);
+void            virtio_disk_poll(int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
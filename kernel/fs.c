@@ -43,27 +43,32 @@ fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  bsetmeta(dev, sb.inodestart, sb.bmapstart + sb.size/BPB + 1);
   initlog(dev, &sb);
 }
 
 // Zero a block.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
   bp = bread(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  if(data)
+    log_data(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Allocate a zeroed disk block, for file data if data
+// is set, or else for metadata.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, int data)
 {
   int b, bi, m;
   struct buf *bp;
@@ -74,10 +79,12 @@ balloc(uint dev)
     for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
+        if(data && log_freed(b + bi))
+          continue;  // not safe for data until committed
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
+        bzero(dev, b + bi, data);
         return b + bi;
       }
     }
@@ -87,9 +94,9 @@ balloc(uint dev)
   return 0;
 }
 
-// Free a disk block.
+// Free a disk block; meta says whether it held metadata.
 static void
-bfree(int dev, uint b)
+bfree(int dev, uint b, int meta)
 {
   struct buf *bp;
   int bi, m;
@@ -102,6 +109,7 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_free(b, meta);
 }
 
 // Inodes.
@@ -172,21 +180,144 @@ bfree(int dev, uint b)
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+//
+// iget() finds inodes through a hash table keyed by (dev, inum).
+// An inode whose ref falls to zero stays in the table, still
+// valid, on an LRU list, so that using it again soon needn't
+// read it from disk; iget() recycles the least recently used.
+// Like the buffer cache, the table is carved out of kalloc'd
+// pages, grows a page at a time up to MAXINODE inodes, and
+// gives idle pages back through ireclaim() when memory runs
+// out.  It never shrinks below NINODE.
+
+#define NIBUCKET 1021
+#define IHASH(dev, inum) ((((dev)<<16) ^ (inum)) % NIBUCKET)
+#define IPERPAGE (PGSIZE / sizeof(struct inode))
+#define RECLAIMBATCH 16  // pages ireclaim() tries to free per call
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *bucket[NIBUCKET];  // through hnext
+  struct inode lru;  // unreferenced inodes, through next/prev;
+                     // lru.next is the least recently used
+  int ninode;
 } itable;
 
+static void dcinit(void);
+static void dcpurge(struct inode*);
+
+// Put ip on the LRU list, at the most recently used end,
+// or, if it holds nothing worth keeping, at the other.
+// Caller must hold itable.lock.
+static void
+lruadd(struct inode *ip)
+{
+  if(ip->valid){
+    ip->prev = itable.lru.prev;
+    ip->next = &itable.lru;
+  } else {
+    ip->prev = &itable.lru;
+    ip->next = itable.lru.next;
+  }
+  ip->prev->next = ip;
+  ip->next->prev = ip;
+}
+
+static void
+lrudel(struct inode *ip)
+{
+  ip->prev->next = ip->next;
+  ip->next->prev = ip->prev;
+}
+
+// Remove ip from its hash chain.  Caller must hold itable.lock.
+static void
+iunhash(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &itable.bucket[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+    ;
+  *pp = ip->hnext;
+}
+
+// Add a page's worth of empty inodes to the LRU list.
+// Caller must hold itable.lock.
+static void
+iaddpage(void *pa)
+{
+  struct inode *ip;
+
+  for(ip = pa; ip < (struct inode*)pa + IPERPAGE; ip++){
+    memset(ip, 0, sizeof(*ip));
+    initsleeplock(&ip->lock, "inode");
+    lruadd(ip);
+  }
+  itable.ninode += IPERPAGE;
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
+  void *pa;
+
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.lru.next = itable.lru.prev = &itable.lru;
+  while(itable.ninode < NINODE){
+    if((pa = kalloc()) == 0)
+      panic("iinit");
+    acquire(&itable.lock);
+    iaddpage(pa);
+    release(&itable.lock);
   }
+  dcinit();
+}
+
+// Free the page of inodes starting at pg if none of
+// them is referenced.  Caller must hold itable.lock.
+static int
+ifreepage(struct inode *pg)
+{
+  struct inode *ip;
+
+  for(ip = pg; ip < pg + IPERPAGE; ip++)
+    if(ip->ref > 0)
+      return 0;
+  for(ip = pg; ip < pg + IPERPAGE; ip++){
+    if(ip->dev != 0)
+      iunhash(ip);
+    lrudel(ip);
+  }
+  itable.ninode -= IPERPAGE;
+  kfree(pg);
+  return 1;
+}
+
+// Give pages of idle inodes back to the page allocator,
+// least recently used first.  Called by kalloc() when it
+// runs out of memory, so it never waits for itable.lock.
+// Returns the number of pages freed.
+int
+ireclaim(void)
+{
+  struct inode *ip;
+  int n;
+
+  if(!tryacquire(&itable.lock))
+    return 0;
+  n = 0;
+  ip = itable.lru.next;
+  while(ip != &itable.lru && n < RECLAIMBATCH &&
+        itable.ninode - IPERPAGE >= NINODE){
+    if(ifreepage((struct inode*)PGROUNDDOWN((uint64)ip))){
+      n++;
+      ip = itable.lru.next;  // the list has changed
+    } else {
+      ip = ip->next;
+    }
+  }
+  release(&itable.lock);
+  return n;
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -246,31 +377,50 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  void *pa;
+  int grow;
 
   acquire(&itable.lock);
-
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
+  for(grow = 1; ; ){
+    // Is the inode already in the table?
+    for(ip = itable.bucket[IHASH(dev, inum)]; ip; ip = ip->hnext){
+      if(ip->dev == dev && ip->inum == inum){
+        if(ip->ref++ == 0)
+          lrudel(ip);
+        release(&itable.lock);
+        return ip;
+      }
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+
+    // Grow rather than recycle a cached inode while below
+    // the limit.  kalloc() may call ireclaim(), so drop the
+    // lock, and look again afterwards.
+    ip = itable.lru.next;
+    if(!grow || itable.ninode >= MAXINODE ||
+       (ip != &itable.lru && ip->dev == 0))
+      break;
+    release(&itable.lock);
+    pa = kalloc();
+    acquire(&itable.lock);
+    if(pa)
+      iaddpage(pa);
+    else
+      grow = 0;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Recycle the least recently used inode entry.
+  if(ip == &itable.lru)
     panic("iget: no inodes");
-
-  ip = empty;
+  lrudel(ip);
+  if(ip->dev != 0)
+    iunhash(ip);
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = itable.bucket[IHASH(dev, inum)];
+  itable.bucket[IHASH(dev, inum)] = ip;
   release(&itable.lock);
 
   return ip;
@@ -310,6 +460,7 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->ranext = ip->rawin = ip->raend = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -347,6 +498,8 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -357,7 +510,8 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0)
+    lruadd(ip);
   release(&itable.lock);
 }
 
@@ -387,7 +541,7 @@ bmap(struct inode *ip, uint bn)
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, ip->type == T_FILE);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -399,7 +553,7 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, 0);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
@@ -407,7 +561,7 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, ip->type == T_FILE);
       if(addr){
         a[bn] = addr;
         log_write(bp);
@@ -420,6 +574,72 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Like bmap, but return 0 instead of allocating.
+static uint
+bmapped(struct inode *ip, uint bn)
+{
+  uint addr;
+  struct buf *bp;
+
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
+  bn -= NDIRECT;
+
+  if(bn < NINDIRECT && ip->addrs[NDIRECT]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    addr = ((uint*)bp->data)[bn];
+    brelse(bp);
+    return addr;
+  }
+  return 0;
+}
+
+// Read-ahead.
+//
+// readi calls readahead for each block it reads.  While an
+// inode is being read sequentially, readahead keeps the next
+// ip->rawin blocks on their way into the buffer cache, so the
+// disk works while the reader copies out the current block.
+// The window starts at RAMIN blocks and doubles, up to RAMAX,
+// each time the reader gets halfway through the blocks already
+// requested.  A non-sequential read shuts it off again.
+
+#define RAMIN 4
+#define RAMAX 32
+
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint b, end, nblocks, addr;
+
+  if(bn + 1 == ip->ranext)
+    return;      // still in the same block
+  if(bn != ip->ranext){
+    ip->ranext = bn + 1;
+    ip->rawin = 0;
+    ip->raend = bn + 1;
+    return;
+  }
+  ip->ranext = bn + 1;
+
+  if(ip->raend > bn + ip->rawin/2)
+    return;      // enough already on the way
+  ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = min(bn + 1 + ip->rawin, nblocks);
+  blkplug();
+  for(b = (ip->raend > bn ? ip->raend : bn + 1); b < end; b++){
+    if((addr = bmapped(ip, b)) == 0)
+      break;
+    breadahead(ip->dev, addr);
+  }
+  blkunplug();
+  if(b > ip->raend)
+    ip->raend = b;
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -431,7 +651,7 @@ itrunc(struct inode *ip)
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
+      bfree(ip->dev, ip->addrs[i], ip->type != T_FILE);
       ip->addrs[i] = 0;
     }
   }
@@ -441,10 +661,10 @@ itrunc(struct inode *ip)
     a = (uint*)bp->data;
     for(j = 0; j < NINDIRECT; j++){
       if(a[j])
-        bfree(ip->dev, a[j]);
+        bfree(ip->dev, a[j], ip->type != T_FILE);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    bfree(ip->dev, ip->addrs[NDIRECT], 1);
     ip->addrs[NDIRECT] = 0;
   }
 
@@ -483,6 +703,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
+    readahead(ip, off/BSIZE);
     bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
@@ -523,7 +744,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if(ip->type == T_FILE)
+      log_data(bp);  // ordered data, not logged
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -539,6 +763,14 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 }
 
 // Directories
+//
+// A directory is a linear list of dirents until it outgrows
+// its first block.  Then it is converted to a hash table
+// (extendible hashing; see fs.h), so that looking up or adding
+// a name reads the header and one bucket however many names
+// there are.  A bucket that fills up is split in two, doubling
+// the table if it has to.  Directories that were already
+// bigger than a block when they were made stay linear.
 
 int
 namecmp(const char *s, const char *t)
@@ -546,17 +778,303 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+static uint
+dxhash(const char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Directory lookup cache.  An entry maps a name in a directory
+// to its inum, or to 0 if the name is known to be absent, so that
+// looking up the same paths again needn't read the directories.
+// The table is direct-mapped: a new entry replaces whatever was
+// in its slot.  Callers hold the directory's lock, which keeps
+// its entries in step with its contents; dirlink() and unlink
+// update them, and they are dropped when the directory is freed.
+
+#define NDCACHE 1021
+
+struct dentry {
+  uint dev;
+  uint dir;        // inum of the directory, 0 if unused
+  uint inum;       // 0 if there is no such name
+  char name[DIRSIZ];
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry ent[NDCACHE];
+} dcache;
+
+static void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry*
+dcslot(struct inode *dp, const char *name)
+{
+  return &dcache.ent[(dxhash(name) ^ (dp->inum * 2654435761U) ^ dp->dev) % NDCACHE];
+}
+
+// Look up name in dp in the cache.  Returns 1 and sets
+// *inum if it is there.
+static int
+dcget(struct inode *dp, const char *name, uint *inum)
+{
+  struct dentry *d;
+  int hit;
+
+  acquire(&dcache.lock);
+  d = dcslot(dp, name);
+  hit = d->dir == dp->inum && d->dev == dp->dev && namecmp(name, d->name) == 0;
+  if(hit)
+    *inum = d->inum;
+  release(&dcache.lock);
+  return hit;
+}
+
+// Record that name in dp is inum, or absent if inum is 0.
+void
+dcset(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  d = dcslot(dp, name);
+  d->dev = dp->dev;
+  d->dir = dp->inum;
+  d->inum = inum;
+  strncpy(d->name, name, DIRSIZ);
+  release(&dcache.lock);
+}
+
+// Drop the entries of directory dp, which is being freed.
+static void
+dcpurge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.ent; d < dcache.ent + NDCACHE; d++)
+    if(d->dir == dp->inum && d->dev == dp->dev)
+      d->dir = 0;
+  release(&dcache.lock);
+}
+
+// Entry i of the table in header block hb.
+static ushort*
+dxent(struct buf *hb, int i)
+{
+  struct dirent *de = (struct dirent*)hb->data + 1 + i/DXPERENT;
+
+  return (ushort*)de->name + i%DXPERENT;
+}
+
+// The bucket of name in directory dp, or 0 if dp is linear.
+static uint
+dxbucket(struct inode *dp, const char *name)
+{
+  struct buf *hb;
+  struct dxhead *h;
+  uint bn;
+
+  if(dp->size <= BSIZE)
+    return 0;
+  hb = bread(dp->dev, bmap(dp, 0));
+  h = (struct dxhead*)hb->data;
+  bn = 0;
+  if(h->inum == 0 && memcmp(h->magic, DXMAGIC, sizeof(h->magic)) == 0)
+    bn = *dxent(hb, dxhash(name) & ((1 << h->depth) - 1));
+  brelse(hb);
+  return bn;
+}
+
+// Turn linear directory dp, whose one block is full, into a
+// hashed directory with two buckets.
+static int
+dxconvert(struct inode *dp)
+{
+  struct buf *hb, *bp[2];
+  struct dxhead *h;
+  struct dirent *de, *ne[2];
+  uint addr[2];
+  int i;
+
+  for(i = 0; i < 2; i++)
+    if((addr[i] = bmap(dp, 1+i)) == 0)
+      return -1;
+  hb = bread(dp->dev, bmap(dp, 0));
+  for(i = 0; i < 2; i++){
+    bp[i] = bread(dp->dev, addr[i]);
+    ne[i] = (struct dirent*)bp[i]->data;
+  }
+  for(de = (struct dirent*)hb->data; de < (struct dirent*)(hb->data + BSIZE); de++){
+    if(de->inum == 0)
+      continue;
+    i = dxhash(de->name) & 1;
+    *ne[i]++ = *de;
+  }
+
+  memset(hb->data, 0, BSIZE);
+  h = (struct dxhead*)hb->data;
+  memmove(h->magic, DXMAGIC, sizeof(h->magic));
+  h->depth = 1;
+  *dxent(hb, 0) = 1;
+  *dxent(hb, 1) = 2;
+  dp->size = 3*BSIZE;
+  iupdate(dp);
+
+  log_write(hb);
+  brelse(hb);
+  for(i = 0; i < 2; i++){
+    log_write(bp[i]);
+    brelse(bp[i]);
+  }
+  return 0;
+}
+
+// Split the full bucket of names with hash h in hashed
+// directory dp, adding a bucket at the end of dp.
+static int
+dxsplit(struct inode *dp, uint h)
+{
+  struct buf *hb, *ob, *nb;
+  struct dxhead *hd;
+  struct dirent *de, *ne;
+  uint obn, nbn, addr;
+  int i, n, bit;
+
+  nbn = dp->size / BSIZE;
+  hb = bread(dp->dev, bmap(dp, 0));
+  hd = (struct dxhead*)hb->data;
+  obn = *dxent(hb, h & ((1 << hd->depth) - 1));
+
+  // The bucket's names agree in their low bit bits,
+  // so 1<<(depth-bit) entries of the table point to it.
+  n = 0;
+  for(i = 0; i < (1 << hd->depth); i++)
+    if(*dxent(hb, i) == obn)
+      n++;
+  for(bit = hd->depth; n > 1; n >>= 1)
+    bit--;
+  if((bit == hd->depth && hd->depth == DXMAXDEPTH) || nbn >= MAXFILE ||
+     (addr = bmap(dp, nbn)) == 0){
+    brelse(hb);
+    return -1;
+  }
+  if(bit == hd->depth){
+    for(i = 0; i < (1 << hd->depth); i++)
+      *dxent(hb, i + (1 << hd->depth)) = *dxent(hb, i);
+    hd->depth++;
+  }
+
+  // Move the names whose next bit is set to the new bucket.
+  ob = bread(dp->dev, bmap(dp, obn));
+  nb = bread(dp->dev, addr);
+  ne = (struct dirent*)nb->data;
+  for(de = (struct dirent*)ob->data; de < (struct dirent*)(ob->data + BSIZE); de++){
+    if(de->inum != 0 && (dxhash(de->name) >> bit) & 1){
+      *ne++ = *de;
+      memset(de, 0, sizeof(*de));
+    }
+  }
+  for(i = 0; i < (1 << hd->depth); i++)
+    if(*dxent(hb, i) == obn && (i >> bit) & 1)
+      *dxent(hb, i) = nbn;
+  dp->size += BSIZE;
+  iupdate(dp);
+
+  log_write(ob);
+  brelse(ob);
+  log_write(nb);
+  brelse(nb);
+  log_write(hb);
+  brelse(hb);
+  return 0;
+}
+
+// Look for name in block bn of directory dp.
+static struct inode*
+dirscan(struct inode *dp, uint bn, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint inum;
+
+  bp = bread(dp->dev, bmap(dp, bn));
+  for(de = (struct dirent*)bp->data; de < (struct dirent*)(bp->data + BSIZE); de++){
+    if(de->inum != 0 && namecmp(name, de->name) == 0){
+      if(poff)
+        *poff = bn*BSIZE + (de - (struct dirent*)bp->data)*sizeof(*de);
+      inum = de->inum;
+      brelse(bp);
+      return iget(dp->dev, inum);
+    }
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Add (name, inum) to hashed directory dp, splitting
+// name's bucket if it is full.
+static int
+dxlink(struct inode *dp, char *name, uint inum)
+{
+  struct buf *bp;
+  struct dirent *de;
+  int split;
+
+  for(split = 0; ; split++){
+    bp = bread(dp->dev, bmap(dp, dxbucket(dp, name)));
+    for(de = (struct dirent*)bp->data; de < (struct dirent*)(bp->data + BSIZE); de++){
+      if(de->inum == 0){
+        strncpy(de->name, name, DIRSIZ);
+        de->inum = inum;
+        log_write(bp);
+        brelse(bp);
+        return 0;
+      }
+    }
+    brelse(bp);
+    // One split per name keeps an op within MAXOPBLOCKS.
+    if(split > 0 || dxsplit(dp, dxhash(name)) < 0)
+      return -1;
+  }
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Callers that don't want the offset are answered
+// from the lookup cache if they can be.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
+  uint off, inum, bn;
   struct dirent de;
+  struct inode *ip;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(poff == 0){
+    if(dcget(dp, name, &inum))
+      return inum ? iget(dp->dev, inum) : 0;
+    ip = dirlookup(dp, name, &off);
+    dcset(dp, name, ip ? ip->inum : 0);
+    return ip;
+  }
+
+  if((bn = dxbucket(dp, name)) != 0)
+    return dirscan(dp, bn, name, poff);
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -589,19 +1107,29 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
-  }
+  if(dxbucket(dp, name) == 0){
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+    if(off < BSIZE || dp->size > BSIZE){
+      strncpy(de.name, name, DIRSIZ);
+      de.inum = inum;
+      if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        return -1;
+      dcset(dp, name, inum);
+      return 0;
+    }
+    if(dxconvert(dp) < 0)
+      return -1;
+  }
+  if(dxlink(dp, name, inum) < 0)
     return -1;
-
+  dcset(dp, name, inum);
   return 0;
 }
 
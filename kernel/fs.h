@@ -24,6 +24,15 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
+// Each log region starts with a header of LOGHEADWORDS words
+// and a block # per logged block, followed by the logged blocks.
+// A transaction logs at most LOGMAX blocks, so a region of more
+// than MAXLOGREGION blocks is never used in full.
+#define LOGHEADWORDS 4
+#define LOGMAX 512
+#define MAXLOGHEAD ((LOGHEADWORDS + LOGMAX) * sizeof(uint) / BSIZE + 1)
+#define MAXLOGREGION (MAXLOGHEAD + LOGMAX)
+
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
@@ -58,3 +67,22 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory that outgrows its first block is hashed: the
+// first block becomes a header, and the rest are buckets of
+// dirents.  The header is laid out as dirents with inum 0, so
+// that programs reading the directory skip it.  The first holds
+// DXMAGIC and the depth of the table, and the names of the others
+// hold the table, DXPERENT entries each.  Entry i of the table is
+// the bucket (block # in the directory) of the names whose hash's
+// low depth bits are i.
+#define DXMAGIC "\177dx"
+#define DXPERENT (DIRSIZ / sizeof(ushort))
+#define DXMAXDEPTH 8   // 1<<DXMAXDEPTH entries fit in a block
+
+struct dxhead {
+  ushort inum;     // always 0
+  char magic[4];   // DXMAGIC
+  ushort depth;    // the table has 1<<depth entries
+  char unused[8];
+};
+
@@ -0,0 +1,24 @@
+// File system statistics, returned by fsstat(kind, st).
+
+#define FSSTAT_BCACHE 1  // struct bcachestat
+#define FSSTAT_LOG    2  // struct logstat
+
+struct bcachestat {
+  uint64 hits;       // bget found the block cached
+  uint64 misses;     // bget had to give the block a buffer
+  uint64 evictions;  // a cached block was dropped to make room
+  uint64 reclaimed;  // buffers freed because memory ran out
+  uint nbuf;         // buffers now in the cache
+  uint maxbuf;       // largest the cache may grow
+  uint nhot;         // buffers in the protected (hot) set
+};
+
+struct logstat {
+  uint64 logged;     // blocks added to a transaction's log
+  uint64 absorbed;   // log_write()s of blocks already in it
+  uint64 data;       // file data blocks added to a transaction
+  uint64 dabsorbed;  // log_data()s of blocks already in it
+  uint64 commits;    // transactions committed
+  uint64 waits;      // times begin_op() waited for log space
+  uint cap;          // most blocks in a transaction
+};
@@ -91,13 +91,20 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r){
-    kmem.freelist = r->next;
-    kmem.refer_count[((uint64)r - KERNBASE) / PGSIZE] = 1;
-  }  
-  release(&kmem.lock);
+  for(;;){
+    acquire(&kmem.lock);
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.refer_count[((uint64)r - KERNBASE) / PGSIZE] = 1;
+    }  
+    release(&kmem.lock);
+
+    // out of memory: ask the buffer cache, then the
+    // inode table, to give some back.
+    if(r || (breclaim() == 0 && ireclaim() == 0))
+      break;
+  }
 
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
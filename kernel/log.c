@@ -6,205 +6,762 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "fsstat.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is only closed when there are
+// no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
+// its start and end, or begin_dataop()/end_dataop() if it
+// writes file data. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the transaction has been closed.
+//
+// Commits are done by the logcommit kernel thread, not by
+// the system calls.  It closes the open transaction as soon
+// as it has no system calls left in it, locks the modified
+// buffers, and opens a new transaction straight away; then
+// it writes the buffers to the log, in one request, and
+// unlocks them, and later installs them, while new system
+// calls run.  Every system call that ends
+// while a commit is being written joins the next transaction,
+// so under load many of them share one commit (group commit).
+// end_op() doesn't wait for any of it; log_sync() waits
+// until the caller's updates are durable.
+//
+// The log is divided into NLOGREGION regions, used in turn,
+// so that a transaction can be written to the log while the
+// one before it is still being installed.  A transaction is
+// finished once it is installed, which is always before its
+// region is needed again.  Installs happen in commit order.
+//
+// Installs write the cache buffers, so they must not write
+// a buffer that a later transaction has changed.  Such a
+// block is left for the later transaction to install, and
+// the transaction isn't finished until that one has committed,
+// so that recovery always finds the block in a committed log.
+//
+// Only metadata goes through the log.  File data blocks are
+// written straight to their home locations, before the commit
+// record of the transaction that allocated them or changed
+// them, so a committed inode never points at blocks whose data
+// didn't make it (ordered data).
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// The on-disk format of a log region:
+//   header blocks, containing seq, tail, checksum,
+//     and block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// A transaction's header and blocks go to the disk in a
+// single request, and the checksum covers all of them, so
+// a region whose checksum is right holds a committed
+// transaction.  Regions are never erased.  Instead, each
+// header records the oldest transaction that wasn't finished
+// when it was written (tail), and recovery replays the valid
+// regions from the newest header's tail onwards, in seq order.
+//
+// So a transaction that was committed but not finished may be
+// replayed by recovery.  A block freed from a directory or
+// an indirect block must not be reused for file data until a
+// header says the transaction that freed it is finished, or
+// the replay could write the old metadata over the data.
+// Such blocks are kept in quarantine until then.  A freed
+// file data block is kept in quarantine until the transaction
+// that freed it commits, since until then the committed inode
+// still points at it, and file data is written in place.
+// The quarantine is a pair of bitmaps of the disk for each
+// transaction that may still be replayed, so an op can free
+// any number of blocks without reserving room first.
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// A transaction's header, used to keep track in memory of
+// logged block# before commit.  On disk the fields are followed
+// by block[], over the first log.nhead blocks of the region.
+// mkfs chooses the size of the log, so block[] is allocated by
+// initlog(), log.cap entries.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  uint seq;
+  uint tail;   // transactions before this one are finished
+  uint cksum;  // of the header and the blocks
+  int *block;
+};
+
+// A region of the log, and the transaction it holds.
+// Only logcommit uses these after recovery.
+struct logregion {
+  int start;       // block # of its header
+  struct logheader lh;
+  int installing;  // install writes are in flight
+  uint after;      // can't erase until this transaction commits
+  struct buf **home; // cache buffers being logged or installed
+  int ndata;       // file data blocks of the transaction
+  int *data;
+  struct buf **dbuf;
+};
+
+// A bitmap of the disk's blocks, log.qpages pages of it, and
+// which of those pages have bits set, so clearing it needn't
+// touch the others.
+struct qmap {
+  uchar **page;
+  uchar *set;
+};
+#define QBITS (PGSIZE*8)   // blocks per page of a qmap
+
+// Transactions whose frees may still be quarantined: those
+// from the tail of the last header written to the open one.
+// logcommit is at most one commit behind, so that's four.
+#define NQGEN 4
+
+// The open transaction's blocks, hashed by block #, so that
+// log_write() and log_data() needn't search the lists.
+// Entries with an older seq are empty, so opening a
+// transaction needn't clear the table.
+#define NLOGHASH 2048   // >= 2*(LOGMAX+LOGMAX), a power of 2
+struct logent {
+  uint blockno;
+  uint seq;
+  int data;        // index in log.data[], or -1 if in log.lh
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in each region
+  int nhead;       // header blocks in each region
+  int cap;         // most blocks in a transaction
+  int maxdata;     // most file data blocks in a transaction
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int ndataop;     // how many of them write file data.
+  int closing;     // logcommit is closing the transaction, please wait.
+  int nsync;       // processes waiting in log_sync().
   int dev;
-  struct logheader lh;
+  struct logheader lh; // the open transaction
+  int ndata;       // its file data blocks
+  int *data;
+  uint seq;        // number of the open transaction
+  uint durable;    // transactions up to this one are committed
+  uint tail;       // tail of the last header written
+  int qpages;      // pages in each quarantine bitmap
+  struct {
+    struct qmap meta;  // metadata blocks it freed
+    struct qmap data;  // file data blocks it freed
+    int nmeta;
+  } quar[NQGEN];   // by seq % NQGEN
+  struct logregion region[NLOGREGION];
+  struct logent hash[NLOGHASH];
+  struct logstat st;
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void logcommit(void);
+
+#if NLOGREGION < 2
+#error "the log needs two regions"
+#endif
+
+// The region transaction seq goes in.
+#define REGION(seq) (&log.region[(seq) % NLOGREGION])
+
+// Transaction seq's quarantine.
+#define QUAR(seq) (&log.quar[(seq) % NQGEN])
+
+// Allocate a qmap of log.qpages pages, all clear.
+static void
+qalloc(struct qmap *m)
+{
+  int i;
+
+  if ((m->page = kalloc()) == 0)
+    panic("initlog: kalloc");
+  m->set = (uchar*)(m->page + log.qpages);
+  for (i = 0; i < log.qpages; i++) {
+    if ((m->page[i] = kalloc()) == 0)
+      panic("initlog: kalloc");
+    memset(m->page[i], 0, PGSIZE);
+    m->set[i] = 0;
+  }
+}
+
+static void
+qset(struct qmap *m, uint b)
+{
+  m->page[b / QBITS][b % QBITS / 8] |= 1 << (b % 8);
+  m->set[b / QBITS] = 1;
+}
+
+static int
+qtest(struct qmap *m, uint b)
+{
+  return (m->page[b / QBITS][b % QBITS / 8] & (1 << (b % 8))) != 0;
+}
+
+static void
+qclear(struct qmap *m)
+{
+  int i;
+
+  for (i = 0; i < log.qpages; i++) {
+    if (m->set[i]) {
+      memset(m->page[i], 0, PGSIZE);
+      m->set[i] = 0;
+    }
+  }
+}
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  int i;
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog / NLOGREGION;
   log.dev = dev;
+
+  if (log.size < MAXOPBLOCKS + 1)
+    panic("initlog: log too small");
+
+  // Split each region between the header and the blocks.
+  log.nhead = 1;
+  while ((LOGHEADWORDS + log.size - log.nhead) * sizeof(uint) > log.nhead * BSIZE)
+    log.nhead++;
+  log.cap = log.size - log.nhead;
+  if (log.cap > LOGMAX) {
+    log.cap = LOGMAX;
+    log.nhead = (LOGHEADWORDS + log.cap) * sizeof(uint) / BSIZE + 1;
+  }
+  if (log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
+
+  // Allow as many ops that write file data in a transaction
+  // as the log allows ops.
+  log.maxdata = log.cap / MAXOPBLOCKS * MAXOPDATA;
+  if (log.maxdata > LOGMAX)
+    log.maxdata = LOGMAX;
+
+  // A qmap's page pointers and set flags share a page.
+  log.qpages = (sb->size + QBITS - 1) / QBITS;
+  if (log.qpages * (sizeof(uchar*) + 1) > PGSIZE)
+    panic("initlog: disk too big");
+
+  // The arrays of blocks and buffers each take a page.
+  if (LOGMAX * sizeof(struct buf*) > PGSIZE)
+    panic("initlog: LOGMAX");
+  if ((log.lh.block = kalloc()) == 0 || (log.data = kalloc()) == 0)
+    panic("initlog: kalloc");
+  for (i = 0; i < NLOGREGION; i++) {
+    log.region[i].start = log.start + i*log.size;
+    if ((log.region[i].lh.block = kalloc()) == 0 ||
+        (log.region[i].home = kalloc()) == 0 ||
+        (log.region[i].data = kalloc()) == 0 ||
+        (log.region[i].dbuf = kalloc()) == 0)
+      panic("initlog: kalloc");
+  }
+  for (i = 0; i < NQGEN; i++) {
+    qalloc(&log.quar[i].meta);
+    qalloc(&log.quar[i].data);
+  }
   recover_from_log();
+  kthread(logcommit, "logcommit");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log region r to their home location
+// during recovery.
+// The writes all go to the disk at once, then we wait for them.
 static void
-install_trans(int recovering)
+install_trans(struct logregion *r)
 {
   int tail;
+  struct buf **dbuf = r->home;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
+  blkplug();
+  for (tail = 0; tail < r->lh.n; tail++) {
+    struct buf *lbuf = bread(log.dev, r->start+log.nhead+tail); // read log block
+    dbuf[tail] = bread(log.dev, r->lh.block[tail]); // read dst
+    memmove(dbuf[tail]->data, lbuf->data, BSIZE);  // copy block to dst
+    bwritestart(dbuf[tail]);  // write dst to disk
     brelse(lbuf);
-    brelse(dbuf);
+  }
+  blkunplug();
+  for (tail = 0; tail < r->lh.n; tail++) {
+    bwait(dbuf[tail]);
+    brelse(dbuf[tail]);
   }
 }
 
-// Read the log header from disk into the in-memory log header
-static void
-read_head(void)
+static uint
+fnv(uint h, void *p, int n)
+{
+  uint *w = p;
+
+  for (; n > 0; n -= sizeof(uint))
+    h = (h ^ *w++) * 16777619;
+  return h;
+}
+
+// Checksum of the transaction described by lh,
+// whose blocks' contents are in b[].
+static uint
+cksum(struct logheader *lh, struct buf **b)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  uint h;
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
-  brelse(buf);
+
+  h = 2166136261;
+  h = fnv(h, &lh->n, sizeof(lh->n));
+  h = fnv(h, &lh->seq, sizeof(lh->seq));
+  h = fnv(h, &lh->tail, sizeof(lh->tail));
+  h = fnv(h, lh->block, lh->n * sizeof(lh->block[0]));
+  for (i = 0; i < lh->n; i++)
+    h = fnv(h, b[i]->data, BSIZE);
+  return h;
+}
+
+// Word w of a header whose blocks are hb[].
+static uint*
+headword(struct buf **hb, int w)
+{
+  return (uint*)hb[w / (BSIZE/sizeof(uint))]->data + w % (BSIZE/sizeof(uint));
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Read region r's header from disk into r->lh.
+// Returns 1 if it is a committed transaction.
+static int
+read_head(struct logregion *r)
+{
+  struct buf *hb[MAXLOGHEAD];
+  struct buf **lbuf = r->home;
+  int i, ok;
+
+  for (i = 0; i < log.nhead; i++)
+    hb[i] = bread(log.dev, r->start+i);
+  r->lh.n = *headword(hb, 0);
+  r->lh.seq = *headword(hb, 1);
+  r->lh.tail = *headword(hb, 2);
+  r->lh.cksum = *headword(hb, 3);
+  ok = r->lh.n >= 0 && r->lh.n <= log.cap;
+  for (i = 0; ok && i < r->lh.n; i++)
+    r->lh.block[i] = *headword(hb, LOGHEADWORDS+i);
+  for (i = 0; i < log.nhead; i++)
+    brelse(hb[i]);
+  if (!ok)
+    return 0;
+
+  blkplug();
+  for (i = 0; i < r->lh.n; i++)
+    breadahead(log.dev, r->start+log.nhead+i);
+  blkunplug();
+  for (i = 0; i < r->lh.n; i++)
+    lbuf[i] = bread(log.dev, r->start+log.nhead+i);
+  ok = cksum(&r->lh, lbuf) == r->lh.cksum;
+  for (i = 0; i < r->lh.n; i++)
+    brelse(lbuf[i]);
+  return ok;
+}
+
+// Fill in region r's header blocks hb[] from r->lh, with the
+// transaction's blocks' contents in b[], and leave them locked.
 static void
-write_head(void)
+fill_head(struct logregion *r, struct buf **b, struct buf **hb)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
-  bwrite(buf);
-  brelse(buf);
+
+  for (i = 0; i < log.nhead; i++)
+    hb[i] = bread(log.dev, r->start+i);
+  r->lh.cksum = cksum(&r->lh, b);
+  *headword(hb, 0) = r->lh.n;
+  *headword(hb, 1) = r->lh.seq;
+  *headword(hb, 2) = r->lh.tail;
+  *headword(hb, 3) = r->lh.cksum;
+  for (i = 0; i < r->lh.n; i++)
+    *headword(hb, LOGHEADWORDS+i) = r->lh.block[i];
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct logregion *r, *head, *first;
+  struct buf *hb[MAXLOGHEAD];
+  int valid[NLOGREGION], i;
+  uint from;
+
+  head = 0;
+  for (r = log.region; r < log.region+NLOGREGION; r++) {
+    valid[r - log.region] = read_head(r);
+    if (valid[r - log.region] && (head == 0 || r->lh.seq > head->lh.seq))
+      head = r;
+  }
+  if (head == 0) {
+    log.seq = 1;   // nothing committed
+    log.tail = 1;
+    return;
+  }
+
+  // Copy the unfinished committed transactions from log
+  // to disk, oldest first.
+  for (from = head->lh.tail; ; from = first->lh.seq + 1) {
+    first = 0;
+    for (r = log.region; r < log.region+NLOGREGION; r++)
+      if (valid[r - log.region] && r->lh.seq >= from && r->lh.seq <= head->lh.seq &&
+          (first == 0 || r->lh.seq < first->lh.seq))
+        first = r;
+    if (first == 0)
+      break;
+    install_trans(first);
+  }
+
+  // Record that they are finished, with an empty transaction,
+  // so that they aren't replayed again after blocks they
+  // freed are reused.
+  log.seq = head->lh.seq + 1;
+  r = REGION(log.seq);
+  r->lh.n = 0;
+  r->lh.seq = log.seq;
+  r->lh.tail = log.seq;
+  fill_head(r, 0, hb);
+  for (i = 0; i < log.nhead; i++) {
+    bwritepoll(hb[i]);
+    brelse(hb[i]);
+  }
+  log.durable = log.seq;
+  log.tail = log.seq;
+  log.seq++;
 }
 
-// called at the start of each FS system call.
-void
-begin_op(void)
+static void
+begin(int data)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.cap ||
+              (data && log.ndata + (log.ndataop+1)*MAXOPDATA > log.maxdata)){
       // this op might exhaust log space; wait for commit.
+      log.st.waits++;
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.ndataop += data;
       release(&log.lock);
       break;
     }
   }
 }
 
+static void
+end(int data)
+{
+  acquire(&log.lock);
+  log.outstanding -= 1;
+  log.ndataop -= data;
+  // logcommit may be waiting for the transaction to be idle,
+  // and begin_op() may be waiting for log space, since
+  // decrementing log.outstanding has decreased the amount
+  // of reserved space.
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin(0);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// if this was the last outstanding operation, logcommit
+// can close the transaction.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  end(0);
+}
+
+// Like begin_op(), for a system call that writes file data,
+// which also reserves room for MAXOPDATA data blocks.
+void
+begin_dataop(void)
+{
+  begin(1);
+}
+
+void
+end_dataop(void)
+{
+  end(1);
+}
+
+// Wait until the updates of every FS system call that has
+// returned are committed.
+void
+log_sync(void)
+{
+  uint want;
 
   acquire(&log.lock);
-  log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  want = log.lh.n > 0 || log.ndata > 0 ? log.seq : log.seq - 1;
+  log.nsync++;
+  wakeup(&log);
+  while(log.durable < want)
+    sleep(&log.durable, &log.lock);
+  log.nsync--;
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Lock the closed transaction's buffers, so that the next
+// transaction can't change them until they are on disk.
+static void
+lock_trans(struct logregion *r)
+{
+  int i;
+
+  for (i = 0; i < r->lh.n; i++)
+    r->home[i] = bread(log.dev, r->lh.block[i]);  // still pinned
+  for (i = 0; i < r->ndata; i++)
+    r->dbuf[i] = bread(log.dev, r->data[i]);
+}
+
+// Write the file data to its home locations, then the header
+// and the cache buffers to the log, and unlock them.  The log
+// goes to consecutive blocks, so the block queue sends it to
+// the disk as one request, which commits the transaction.
+static void
+write_log(struct logregion *r)
+{
+  int tail, i;
+  struct buf *hb[MAXLOGHEAD];
+
+  if (r->ndata > 0) {
+    blkplug();
+    for (tail = 0; tail < r->ndata; tail++)
+      bwritestart(r->dbuf[tail]);
+    blkunplug();
+    for (tail = 0; tail < r->ndata; tail++) {
+      bwait(r->dbuf[tail]);
+      brelse(r->dbuf[tail]);
+      bunpin(r->dbuf[tail]);
+    }
+  }
+
+  fill_head(r, r->home, hb);
+  blkplug();
+  for (i = 0; i < log.nhead; i++)
+    bwritestart(hb[i]);
+  for (tail = 0; tail < r->lh.n; tail++)
+    bwriteto(r->home[tail], r->start+log.nhead+tail);
+  blkunplug();
+  for (i = 0; i < log.nhead; i++) {
+    bwait(hb[i]);
+    brelse(hb[i]);
+  }
+  for (tail = 0; tail < r->lh.n; tail++) {
+    bwait(r->home[tail]);
+    brelse(r->home[tail]);
+  }
+}
+
+// Start writing region r's blocks to their home locations.
+// The block queue sorts and merges the writes.  Each buffer
+// is unlocked as soon as its write is done, so the system
+// calls of the open transaction needn't wait for logcommit.
+// A buffer a later transaction has logged again holds
+// uncommitted data, and is left to that transaction.
+static void
+start_install(struct logregion *r)
+{
+  int tail;
+  struct buf *b;
+
+  r->after = 0;
+  blkplug();
+  for (tail = 0; tail < r->lh.n; tail++) {
+    b = bread(log.dev, r->lh.block[tail]);
+    if (b->lseq != r->lh.seq) {
+      if (b->lseq > r->after)
+        r->after = b->lseq;
+      brelse(b);
+      bunpin(b);
+      r->home[tail] = 0;
+    } else {
+      bwriterelse(b);
+      r->home[tail] = b;
+    }
   }
+  blkunplug();
+  r->installing = 1;
 }
 
-// Copy modified blocks from cache to log.
+// Can region r be finished yet?
+// Caller must hold log.lock.
+static int
+installed(struct logregion *r)
+{
+  return r->installing && r->after <= log.durable;
+}
+
+// Wait for region r's install writes.
 static void
-write_log(void)
+finish_install(struct logregion *r)
 {
   int tail;
+  struct buf *b;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < r->lh.n; tail++) {
+    if (r->home[tail] == 0)
+      continue;
+    // Unlocked once written, and pinned, so still the same buffer.
+    b = bread(log.dev, r->lh.block[tail]);
+    brelse(b);
+    bunpin(b);
   }
+  r->installing = 0;
+}
+
+// Commit the transaction in region r, and start installing it.
+static void
+commit(struct logregion *r)
+{
+  struct logregion *prev;
+
+  prev = REGION(r->lh.seq - 1);
+  r->lh.tail = prev->installing ? prev->lh.seq : r->lh.seq;
+  write_log(r);    // Write data home, then log -- the real commit
+
+  acquire(&log.lock);
+  log.durable = r->lh.seq;
+  log.tail = r->lh.tail;
+  log.st.commits++;
+  wakeup(&log.durable);
+  release(&log.lock);
+
+  // The last transaction's installs were overlapped with
+  // writing this one's log; they must finish before this
+  // one's start, which may be to the same blocks.  Anything
+  // it left to a later transaction is in this one's log now.
+  if(prev->installing)
+    finish_install(prev);
+  start_install(r);
 }
 
+// Should logcommit close the open transaction now?
+// Caller must hold log.lock.
+static int
+ready(void)
+{
+  uint s;
+
+  if(log.lh.n > 0 || log.ndata > 0)
+    return log.outstanding == 0 || log.nsync > 0;
+  // An empty transaction is worth committing only to record
+  // that the last one has finished, so that the blocks in
+  // quarantine can be reused.
+  if(log.outstanding > 0 || REGION(log.seq - 1)->installing)
+    return 0;
+  for(s = log.tail; s < log.seq; s++)
+    if(QUAR(s)->nmeta > 0)
+      return 1;
+  return 0;
+}
+
+// The commit thread.
 static void
-commit()
+logcommit(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  struct logregion *r;
+
+  acquire(&log.lock);
+  for(;;){
+    // Wait for a transaction with something in it that has
+    // no system calls left in it, or that someone needs now.
+    // Tidy up the last install meanwhile, if it can be.
+    while(!ready()){
+      r = REGION(log.seq - 1);
+      if(installed(r)){
+        release(&log.lock);
+        finish_install(r);
+        acquire(&log.lock);
+        continue;
+      }
+      sleep(&log, &log.lock);
+    }
+
+    // Let no more system calls join it.
+    log.closing = 1;
+    while(log.outstanding > 0)
+      sleep(&log, &log.lock);
+    r = REGION(log.seq);
+    r->lh.n = log.lh.n;
+    memmove(r->lh.block, log.lh.block, log.lh.n * sizeof(log.lh.block[0]));
+    r->lh.seq = log.seq;
+    r->ndata = log.ndata;
+    memmove(r->data, log.data, log.ndata * sizeof(log.data[0]));
+    release(&log.lock);
+
+    lock_trans(r);
+
+    // Open the next transaction.  The one that last used its
+    // quarantine is older than the tail.
+    acquire(&log.lock);
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.ndata = 0;
+    log.seq++;
+    qclear(&QUAR(log.seq)->meta);
+    qclear(&QUAR(log.seq)->data);
+    QUAR(log.seq)->nmeta = 0;
+    log.closing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    commit(r);
+
+    acquire(&log.lock);
+  }
+}
+
+// Find block blockno's entry in the hash table, or the empty
+// slot where it goes.  Caller must hold log.lock.
+static struct logent*
+lookup(uint blockno)
+{
+  struct logent *e;
+  uint h;
+
+  for (h = blockno * 2654435761U; ; h++) {
+    e = &log.hash[h % NLOGHASH];
+    if (e->seq != log.seq || e->blockno == blockno)
+      return e;
   }
 }
 
+// Take e's block off the open transaction's data list.
+// Caller must hold log.lock.
+static void
+undata(struct logent *e)
+{
+  int i = e->data;
+
+  log.data[i] = log.data[--log.ndata];
+  if (i < log.ndata)
+    lookup(log.data[i])->data = i;
+  e->data = -1;
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// logcommit will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -214,23 +771,105 @@ commit()
 void
 log_write(struct buf *b)
 {
-  int i;
+  struct logent *e;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
-      break;
+  e = lookup(b->blockno);
+  b->lseq = log.seq;
+  if (e->seq == log.seq && e->data < 0) {  // log absorption
+    log.st.absorbed++;
+  } else {  // Add new block to log
+    if (e->seq == log.seq)  // a data block is pinned already
+      undata(e);
+    else
+      bpin(b);
+    e->blockno = b->blockno;
+    e->seq = log.seq;
+    e->data = -1;
+    log.lh.block[log.lh.n++] = b->blockno;
+    log.st.logged++;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  release(&log.lock);
+}
+
+// Like log_write(), but for a block of file data, which
+// is written to its home location rather than the log.
+void
+log_data(struct buf *b)
+{
+  struct logent *e;
+
+  acquire(&log.lock);
+  if (log.ndataop < 1)
+    panic("log_data outside of data op");
+
+  e = lookup(b->blockno);
+  if (e->seq == log.seq) {  // absorption, or logged already
+    log.st.dabsorbed++;
+  } else {
+    if (log.ndata >= log.maxdata)
+      panic("too much data in a transaction");
     bpin(b);
-    log.lh.n++;
+    e->blockno = b->blockno;
+    e->seq = log.seq;
+    e->data = log.ndata;
+    log.data[log.ndata++] = b->blockno;
+    log.st.data++;
   }
   release(&log.lock);
 }
 
+// Block blockno has been freed by the current transaction:
+// quarantine it.  meta says whether it held metadata.
+void
+log_free(uint blockno, int meta)
+{
+  acquire(&log.lock);
+  if (meta) {
+    qset(&QUAR(log.seq)->meta, blockno);
+    QUAR(log.seq)->nmeta++;
+  } else {
+    qset(&QUAR(log.seq)->data, blockno);
+  }
+  release(&log.lock);
+}
+
+// Is block blockno in quarantine, so that it
+// may not be used for file data yet?  A freed metadata
+// block is until a header's tail passes the transaction
+// that freed it, since replay could overwrite it; a freed
+// data block until that transaction commits, since the
+// old inode may point at it.
+int
+log_freed(uint blockno)
+{
+  uint s;
+  int r;
+
+  r = 0;
+  acquire(&log.lock);
+  for (s = log.tail; s <= log.seq; s++) {
+    if (qtest(&QUAR(s)->meta, blockno) ||
+        (s > log.durable && qtest(&QUAR(s)->data, blockno))) {
+      r = 1;
+      break;
+    }
+  }
+  release(&log.lock);
+  return r;
+}
+
+// Copy the log's counters to *st.
+void
+logstat(struct logstat *st)
+{
+  acquire(&log.lock);
+  *st = log.st;
+  st->cap = log.cap;
+  release(&log.lock);
+}
@@ -1,13 +1,18 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC      4096  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // minimum size of inode table
+#define MAXINODE   8192  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGSIZE      (MAXOPBLOCKS*3)  // default blocks in each log region, mkfs -l
+#define NLOGREGION   2  // log regions, so commits overlap installs
+#define MAXOPDATA    64  // max # of file data blocks any FS op writes
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define MAXMERGE     32  // most blocks in one disk request
+#define BCACHEFRAC   8  // disk block cache may use up to 1/BCACHEFRAC of RAM
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
@@ -4,19 +4,44 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "wait.h"
+#include "times.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// The process table. procinit() carves NPROC slots out of
+// kalloc()ed pages. Slots are never given back, so a struct proc
+// pointer always points at a valid slot, even after the process
+// is gone; scheduler() and wakeup() rely on this to walk allproc
+// while holding only one p->lock at a time.
+static struct proc *allproc;    // slots handed out so far, via allnext
+static struct proc *lastproc;   // tail of allproc
+static struct proc *freeprocs;  // UNUSED slots on allproc, via freenext
+static struct proc *newprocs;   // never-used slots, via freenext
+struct spinlock proc_lock;      // protects the lists above
 
 struct proc *initproc;
 
+// pid -> proc, chained through p->pidnext.
+#define NPIDHASH 257
+#define PIDHASH(pid) ((uint)(pid) % NPIDHASH)
+static struct proc *pidhash[NPIDHASH];
+
 int nextpid = 1;
-struct spinlock pid_lock;
+struct spinlock pid_lock;       // protects nextpid, pidhash and p->pid
+
+// bumped whenever a kernel stack is mapped; see kstacksync().
+static uint64 kstackgen;
+
+extern pagetable_t kernel_pagetable;
+
+// bit i is set once hart i has entered scheduler().
+static uint64 onlinecpus;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void siblingpush(struct proc **head, struct proc *c);
 
 extern char trampoline[]; // trampoline.S
 
@@ -26,35 +51,35 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl)
-{
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-  }
-}
-
 // initialize the proc table.
+// each slot gets a kernel stack address high in memory,
+// followed by an invalid guard page. the stack page itself
+// is only allocated and mapped while a process uses the slot.
 void
 procinit(void)
 {
-  struct proc *p;
+  struct proc *p, **tail;
+  int i, j;
   
   initlock(&pid_lock, "nextpid");
+  initlock(&proc_lock, "proc");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
+  tail = &newprocs;
+  for(i = 0; i < NPROC; i += j){
+    if((p = (struct proc *)kalloc()) == 0)
+      panic("procinit: kalloc");
+    memset(p, 0, PGSIZE);
+    for(j = 0; j < PGSIZE/sizeof(struct proc) && i + j < NPROC; j++, p++){
       initlock(&p->lock, "proc");
       p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
+      p->kstack = KSTACK(i + j);
+      // create the page-table pages for the stack now,
+      // so that allocproc() can map it without allocating.
+      if(walk(kernel_pagetable, p->kstack, 1) == 0)
+        panic("procinit: walk");
+      *tail = p;
+      tail = &p->freenext;
+    }
   }
 }
 
@@ -89,20 +114,74 @@ myproc(void)
   return p;
 }
 
-int
-allocpid()
+// Give p a new pid and enter it in pidhash.
+static void
+allocpid(struct proc *p)
 {
-  int pid;
-  
+  int h;
+
   acquire(&pid_lock);
-  pid = nextpid;
+  p->pid = nextpid;
   nextpid = nextpid + 1;
+  h = PIDHASH(p->pid);
+  p->pidnext = pidhash[h];
+  pidhash[h] = p;
   release(&pid_lock);
+}
 
-  return pid;
+// Remove p from pidhash and clear its pid.
+static void
+freepid(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&pid_lock);
+  for(pp = &pidhash[PIDHASH(p->pid)]; *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
+    }
+  }
+  p->pidnext = 0;
+  p->pid = 0;
+  release(&pid_lock);
 }
 
-// Look in the process table for an UNUSED proc.
+// Return the slot that holds pid, without locking it,
+// or 0 if there is none. The slot may be freed and
+// reused by the time the caller looks at it.
+static struct proc*
+pidlookup(int pid)
+{
+  struct proc *p;
+
+  if(pid <= 0)   // pids come from user space
+    return 0;
+  acquire(&pid_lock);
+  for(p = pidhash[PIDHASH(pid)]; p; p = p->pidnext){
+    if(p->pid == pid)
+      break;
+  }
+  release(&pid_lock);
+  return p;
+}
+
+// Flush this CPU's TLB if a kernel stack has been mapped
+// since it last did, in case it still caches a translation
+// from a previous process that used the same slot.
+// Call before switching to a process.
+static void
+kstacksync(struct cpu *c)
+{
+  uint64 gen = kstackgen;
+
+  if(c->kstackgen != gen){
+    c->kstackgen = gen;
+    sfence_vma();
+  }
+}
+
+// Take a slot off the free list.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
 // If there are no free procs, or a memory allocation fails, return 0.
@@ -110,20 +189,41 @@ static struct proc*
 allocproc(void)
 {
   struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  pte_t *pte;
+  char *pa;
+
+  acquire(&proc_lock);
+  if((p = freeprocs) != 0){
+    freeprocs = p->freenext;
+  } else if((p = newprocs) != 0){
+    newprocs = p->freenext;
+    // first use of this slot: make it visible to table scans.
+    __sync_synchronize();
+    if(lastproc)
+      lastproc->allnext = p;
+    else
+      allproc = p;
+    lastproc = p;
   }
-  return 0;
+  release(&proc_lock);
+  if(p == 0)
+    return 0;
 
-found:
-  p->pid = allocpid();
+  acquire(&p->lock);
+  p->freenext = 0;
+  allocpid(p);
   p->state = USED;
+  p->cpumask = ~0L;
+
+  // Allocate and map a kernel stack page.
+  if((pa = kalloc()) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+  pte = walk(kernel_pagetable, p->kstack, 0);
+  *pte = PA2PTE(pa) | PTE_R | PTE_W | PTE_V;
+  __sync_fetch_and_add(&kstackgen, 1);
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -150,11 +250,23 @@ found:
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages and the kernel stack, and put
+// the slot back on the free list.
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
 {
+  pte_t *pte;
+  uint64 pa;
+
+  pte = walk(kernel_pagetable, p->kstack, 0);
+  if(*pte & PTE_V){
+    pa = PTE2PA(*pte);
+    *pte = 0;
+    kfree((void*)pa);
+  }
+  if(p->pid)
+    freepid(p);
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
@@ -162,13 +274,27 @@ freeproc(struct proc *p)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
-  p->pid = 0;
   p->parent = 0;
+  p->children = 0;
+  p->zombies = 0;
+  p->nextsib = 0;
+  p->prevsib = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->cpumask = 0;
+  p->wakee = 0;
+  p->utime = p->stime = 0;
+  p->cutime = p->cstime = 0;
+  p->blkplug = 0;
+  p->kfn = 0;
   p->state = UNUSED;
+
+  acquire(&proc_lock);
+  p->freenext = freeprocs;
+  freeprocs = p;
+  release(&proc_lock);
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -310,12 +436,15 @@ fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->cpumask = p->cpumask;
+
   pid = np->pid;
 
   release(&np->lock);
 
   acquire(&wait_lock);
   np->parent = p;
+  siblingpush(&p->children, np);
   release(&wait_lock);
 
   acquire(&np->lock);
@@ -325,19 +454,53 @@ fork(void)
   return pid;
 }
 
-// Pass p's abandoned children to init.
+// Put c at the front of the sibling list *head.
+// Caller must hold wait_lock.
+static void
+siblingpush(struct proc **head, struct proc *c)
+{
+  c->prevsib = 0;
+  c->nextsib = *head;
+  if(*head)
+    (*head)->prevsib = c;
+  *head = c;
+}
+
+// Take c off the sibling list *head.
+// Caller must hold wait_lock.
+static void
+siblingremove(struct proc **head, struct proc *c)
+{
+  if(c->prevsib)
+    c->prevsib->nextsib = c->nextsib;
+  else
+    *head = c->nextsib;
+  if(c->nextsib)
+    c->nextsib->prevsib = c->prevsib;
+  c->nextsib = 0;
+  c->prevsib = 0;
+}
+
+// Pass p's abandoned children, live and exited, to init.
 // Caller must hold wait_lock.
 void
 reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  if(p->children == 0 && p->zombies == 0)
+    return;
+  while((pp = p->children) != 0){
+    siblingremove(&p->children, pp);
+    pp->parent = initproc;
+    siblingpush(&initproc->children, pp);
+  }
+  while((pp = p->zombies) != 0){
+    siblingremove(&p->zombies, pp);
+    pp->parent = initproc;
+    siblingpush(&initproc->zombies, pp);
   }
+  wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -370,6 +533,10 @@ exit(int status)
   // Give any children to init.
   reparent(p);
 
+  // Move to the parent's list of exited children.
+  siblingremove(&p->parent->children, p);
+  siblingpush(&p->parent->zombies, p);
+
   // Parent might be sleeping in wait().
   wakeup(p->parent);
   
@@ -385,42 +552,53 @@ exit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
+// Wait for the child process pid, or any child if pid is -1,
+// to exit and return its pid.
+// Return -1 if this process has no such child, or
+// 0 if options has WNOHANG and the child is still running.
 int
-wait(uint64 addr)
+wait(int pid, uint64 addr, int options)
 {
   struct proc *pp;
-  int havekids, pid;
+  int havekids;
   struct proc *p = myproc();
 
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if(pp->state == ZOMBIE){
-          // Found one.
-          pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
+    // Exited children are on p->zombies.
+    if(pid == -1){
+      pp = p->zombies;
+      havekids = pp != 0 || p->children != 0;
+    } else {
+      pp = pidlookup(pid);
+      if(pp && pp->parent != p)
+        pp = 0;
+      havekids = pp != 0;
+    }
+
+    if(pp){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&pp->lock);
+
+      if(pp->state == ZOMBIE){
+        // Found one.
+        pid = pp->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                                sizeof(pp->xstate)) < 0) {
           release(&pp->lock);
           release(&wait_lock);
-          return pid;
+          return -1;
         }
+        siblingremove(&p->zombies, pp);
+        p->cutime += pp->utime + pp->cutime;
+        p->cstime += pp->stime + pp->cstime;
+        freeproc(pp);
         release(&pp->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&pp->lock);
     }
 
     // No point waiting if we don't have any children.
@@ -428,6 +606,11 @@ wait(uint64 addr)
       release(&wait_lock);
       return -1;
     }
+
+    if(options & WNOHANG){
+      release(&wait_lock);
+      return 0;
+    }
     
     // Wait for a child to exit.
     sleep(p, &wait_lock);  //DOC: wait-sleep
@@ -444,34 +627,81 @@ wait(uint64 addr)
 void
 scheduler(void)
 {
-  struct proc *p;
+  struct proc *p, *q;
   struct cpu *c = mycpu();
   
   c->proc = 0;
+  __sync_fetch_and_or(&onlinecpus, 1L << cpuid());
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
+    for(p = allproc; p; p = p->allnext) {
       acquire(&p->lock);
-      if(p->state == RUNNABLE) {
+      if(p->state == RUNNABLE && (p->cpumask & (1L << cpuid()))) {
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
         p->state = RUNNING;
         c->proc = p;
+        kstacksync(c);
         swtch(&c->context, &p->context);
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
+        // After direct switches (see sched()) the process coming
+        // back need not be p: it is c->proc and holds its own
+        // lock, while p's lock was released by p's successor.
+        q = c->proc;
         c->proc = 0;
+        release(&q->lock);
+        continue;
       }
       release(&p->lock);
     }
   }
 }
 
-// Switch to scheduler.  Must hold only p->lock
+// If p is blocking and recently woke a process that is still
+// waiting for a CPU (e.g. a pipe reader woken by this writer),
+// return that process locked and ready to be switched to directly.
+// Only tries the lock: p->lock is held, and the other process
+// may be trying to do the same in the opposite direction.
+static struct proc*
+pickwakee(struct proc *p)
+{
+  struct proc *np = p->wakee;
+
+  p->wakee = 0;
+  // a yield() goes through the scheduler, to keep round-robin fair.
+  if(np == 0 || np == p || p->state == RUNNABLE)
+    return 0;
+  if(!tryacquire(&np->lock))
+    return 0;
+  if(np->state != RUNNABLE || (np->cpumask & (1L << cpuid())) == 0){
+    release(&np->lock);
+    return 0;
+  }
+  return np;
+}
+
+// Called on arrival in a process after a switch.
+// If the previous process switched here directly rather
+// than via the scheduler, release its lock on its behalf.
+static void
+finishswitch(void)
+{
+  struct cpu *c = mycpu();
+  struct proc *prev = c->prev;
+
+  if(prev){
+    c->prev = 0;
+    release(&prev->lock);
+  }
+}
+
+// Switch to scheduler, or straight to a process that
+// p just woke.  Must hold only p->lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
@@ -483,6 +713,8 @@ sched(void)
 {
   int intena;
   struct proc *p = myproc();
+  struct proc *np;
+  uint64 now;
 
   if(!holding(&p->lock))
     panic("sched p->lock");
@@ -493,9 +725,25 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+  // charge the time since the last trap or switch to the kernel.
+  now = readmtime();
+  p->stime += now - p->tstart;
+
   intena = mycpu()->intena;
-  swtch(&p->context, &mycpu()->context);
+  if((np = pickwakee(p)) != 0){
+    // Run np directly, skipping the round trip through
+    // the scheduler thread. np releases p->lock on arrival.
+    np->state = RUNNING;
+    mycpu()->proc = np;
+    mycpu()->prev = p;
+    kstacksync(mycpu());
+    swtch(&p->context, &np->context);
+  } else {
+    swtch(&p->context, &mycpu()->context);
+  }
   mycpu()->intena = intena;
+  finishswitch();
+  p->tstart = readmtime();
 }
 
 // Give up the CPU for one scheduling round.
@@ -516,7 +764,9 @@ forkret(void)
 {
   static int first = 1;
 
-  // Still holding p->lock from scheduler.
+  // Still holding p->lock from scheduler or sched().
+  finishswitch();
+  myproc()->tstart = readmtime();
   release(&myproc()->lock);
 
   if (first) {
@@ -530,6 +780,37 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's first scheduling swtches here.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler or sched().
+  finishswitch();
+  p->tstart = readmtime();
+  release(&p->lock);
+
+  p->kfn();
+  panic("kthread returned");
+}
+
+// Start a process that runs fn in the kernel, and never
+// returns to user space.  fn must not return.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -567,18 +848,39 @@ void
 wakeup(void *chan)
 {
   struct proc *p;
+  struct proc *me = myproc();
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  for(p = allproc; p; p = p->allnext) {
+    if(p != me){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
         p->state = RUNNABLE;
+        // remember it, in case we block next (see sched()).
+        if(me)
+          me->wakee = p;
       }
       release(&p->lock);
     }
   }
 }
 
+// Return the process with the given pid, locked,
+// or 0 if there is none.
+static struct proc*
+findproc(int pid)
+{
+  struct proc *p;
+
+  if((p = pidlookup(pid)) == 0)
+    return 0;
+  acquire(&p->lock);
+  // the slot may have been freed and reused meanwhile.
+  if(p->pid == pid && p->state != UNUSED)
+    return p;
+  release(&p->lock);
+  return 0;
+}
+
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
@@ -587,20 +889,57 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
-    release(&p->lock);
+  if((p = findproc(pid)) == 0)
+    return -1;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    p->state = RUNNABLE;
+  }
+  release(&p->lock);
+  return 0;
+}
+
+// Restrict the process with the given pid (0 means the
+// caller) to the CPUs in mask. A process running elsewhere
+// moves the next time it passes through the scheduler.
+int
+setaffinity(int pid, uint64 mask)
+{
+  struct proc *p;
+  int here;
+
+  mask &= onlinecpus;
+  if(mask == 0)
+    return -1;
+  if((p = findproc(pid ? pid : myproc()->pid)) == 0)
+    return -1;
+  p->cpumask = mask;
+  release(&p->lock);
+
+  if(p == myproc()){
+    push_off();
+    here = (mask & (1L << cpuid())) != 0;
+    pop_off();
+    if(!here)
+      yield();
   }
-  return -1;
+  return 0;
+}
+
+// Return the CPUs the process with the given pid
+// (0 means the caller) may run on, or 0 if there is none.
+uint64
+getaffinity(int pid)
+{
+  struct proc *p;
+  uint64 mask;
+
+  if((p = findproc(pid ? pid : myproc()->pid)) == 0)
+    return 0;
+  mask = p->cpumask & onlinecpus;
+  release(&p->lock);
+  return mask;
 }
 
 void
@@ -622,6 +961,27 @@ killed(struct proc *p)
   return k;
 }
 
+// Fill in *t with the caller's CPU time, and that of
+// its waited-for children, in nanoseconds.
+void
+proctimes(struct tms *t)
+{
+  struct proc *p = myproc();
+  uint64 ns = 1000000000 / CLINT_FREQ;
+
+  // bring stime up to date.
+  push_off();
+  uint64 now = readmtime();
+  p->stime += now - p->tstart;
+  p->tstart = now;
+  pop_off();
+
+  t->utime = p->utime * ns;
+  t->stime = p->stime * ns;
+  t->cutime = p->cutime * ns;
+  t->cstime = p->cstime * ns;
+}
+
 // Copy to either a user address, or kernel address,
 // depending on usr_dst.
 // Returns 0 on success, -1 on error.
@@ -667,10 +1027,11 @@ procdump(void)
   [ZOMBIE]    "zombie"
   };
   struct proc *p;
+  struct cpu *c;
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = allproc; p; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -678,6 +1039,12 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    printf(" user %dms sys %dms", (int)(p->utime / (CLINT_FREQ/1000)),
+           (int)(p->stime / (CLINT_FREQ/1000)));
     printf("\n");
   }
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(c->ticks)
+      printf("cpu %d: %d ticks, %d idle\n", (int)(c - cpus), (int)c->ticks, (int)c->idleticks);
+  }
 }
@@ -22,6 +22,10 @@ struct context {
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
+  struct proc *prev;          // Direct switch: whose lock to release on arrival.
+  uint64 kstackgen;           // kstackgen as of this CPU's last TLB flush.
+  uint64 ticks;               // Timer interrupts taken by this CPU.
+  uint64 idleticks;           // ... while in scheduler() with no process.
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
 };
@@ -90,10 +94,22 @@ struct proc {
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
-  int pid;                     // Process ID
+  int pid;                     // Process ID (pid_lock also held to change)
+  uint64 cpumask;              // CPUs this process may run on
 
-  // wait_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *children;       // Live children, linked through nextsib
+  struct proc *zombies;        // Exited children not yet waited for
+  struct proc *nextsib;        // Sibling on parent's children or zombies
+  struct proc *prevsib;
+
+  // proc_lock must be held when using these:
+  struct proc *allnext;        // Next slot in the table (set once)
+  struct proc *freenext;       // Next UNUSED slot on the free list
+
+  // pid_lock must be held when using this:
+  struct proc *pidnext;        // Next proc in the same pidhash chain
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -101,6 +117,14 @@ struct proc {
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
+  struct proc *wakee;          // Last process woken by this one (sched() hint)
+  uint64 tstart;               // mtime when the current utime/stime interval began
+  uint64 utime;                // mtime cycles spent in user mode
+  uint64 stime;                // mtime cycles spent in the kernel
+  uint64 cutime;               // utime of waited-for children, and theirs
+  uint64 cstime;               // stime of waited-for children, and theirs
+  int blkplug;                 // >0 while holding back block I/O (blkplug())
+  void (*kfn)(void);           // body of a kernel thread (kthread())
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
@@ -101,6 +101,13 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_sched_setaffinity(void);
+extern uint64 sys_sched_getaffinity(void);
+extern uint64 sys_waitpid(void);
+extern uint64 sys_uptimens(void);
+extern uint64 sys_times(void);
+extern uint64 sys_fsstat(void);
+extern uint64 sys_fsync(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -126,6 +133,13 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_sched_setaffinity] sys_sched_setaffinity,
+[SYS_sched_getaffinity] sys_sched_getaffinity,
+[SYS_waitpid] sys_waitpid,
+[SYS_uptimens] sys_uptimens,
+[SYS_times]   sys_times,
+[SYS_fsstat]  sys_fsstat,
+[SYS_fsync]   sys_fsync,
 };
 
 void
@@ -20,3 +20,10 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_sched_setaffinity 22
+#define SYS_sched_getaffinity 23
+#define SYS_waitpid 24
+#define SYS_uptimens 25
+#define SYS_times  26
+#define SYS_fsstat 27
+#define SYS_fsync  28
@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "fsstat.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -176,10 +177,12 @@ isdirempty(struct inode *dp)
   int off;
   struct dirent de;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+  // . and .. are the first two entries of a linear directory,
+  // but may be anywhere in a hashed one.
+  for(off=0; off<dp->size; off+=sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if(de.inum != 0)
+    if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0)
       return 0;
   }
   return 1;
@@ -222,6 +225,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcset(dp, name, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -503,3 +507,38 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// copy file system statistics of the given kind to user space.
+uint64
+sys_fsstat(void)
+{
+  int kind;
+  uint64 addr;
+  struct bcachestat bs;
+  struct logstat ls;
+
+  argint(0, &kind);
+  argaddr(1, &addr);
+  switch(kind){
+  case FSSTAT_BCACHE:
+    bstat(&bs);
+    return copyout(myproc()->pagetable, addr, (char*)&bs, sizeof(bs));
+  case FSSTAT_LOG:
+    logstat(&ls);
+    return copyout(myproc()->pagetable, addr, (char*)&ls, sizeof(ls));
+  }
+  return -1;
+}
+
+// wait until the file system updates made so far,
+// including those to the open file fd, are committed.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_sync();
+  return 0;
+}
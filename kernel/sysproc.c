@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "times.h"
 
 uint64
 sys_exit(void)
@@ -32,7 +33,19 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
-  return wait(p);
+  return wait(-1, p, 0);
+}
+
+uint64
+sys_waitpid(void)
+{
+  int pid, options;
+  uint64 p;
+
+  argint(0, &pid);
+  argaddr(1, &p);
+  argint(2, &options);
+  return wait(pid, p, options);
 }
 
 uint64
@@ -91,3 +104,52 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+uint64
+sys_sched_setaffinity(void)
+{
+  int pid;
+  uint64 mask;
+
+  argint(0, &pid);
+  argaddr(1, &mask);
+  return setaffinity(pid, mask);
+}
+
+// copy the CPU mask of process pid to user address addr.
+uint64
+sys_sched_getaffinity(void)
+{
+  int pid;
+  uint64 addr, mask;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  if((mask = getaffinity(pid)) == 0)
+    return -1;
+  if(copyout(myproc()->pagetable, addr, (char *)&mask, sizeof(mask)) < 0)
+    return -1;
+  return 0;
+}
+
+// return nanoseconds since boot, from the CLINT's mtime.
+// finer-grained than uptime(), and takes no lock.
+uint64
+sys_uptimens(void)
+{
+  return readmtime() * (1000000000 / CLINT_FREQ);
+}
+
+// copy the caller's CPU usage to a user struct tms.
+uint64
+sys_times(void)
+{
+  uint64 addr;
+  struct tms t;
+
+  argaddr(0, &addr);
+  proctimes(&t);
+  if(copyout(myproc()->pagetable, addr, (char *)&t, sizeof(t)) < 0)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,8 @@
+// CPU time used by a process, filled in by times().
+// All times are in nanoseconds.
+struct tms {
+  uint64 utime;   // user mode
+  uint64 stime;   // kernel, on the process's behalf
+  uint64 cutime;  // utime of waited-for children
+  uint64 cstime;  // stime of waited-for children
+};
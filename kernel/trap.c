@@ -97,6 +97,12 @@ usertrap(void)
   w_stvec((uint64)kernelvec);
 
   struct proc *p = myproc();
+  uint64 now;
+
+  // charge the time since usertrapret() to user mode.
+  now = readmtime();
+  p->utime += now - p->tstart;
+  p->tstart = now;
   
   // save user program counter.
   p->trapframe->epc = r_sepc();
@@ -153,12 +159,19 @@ void
 usertrapret(void)
 {
   struct proc *p = myproc();
+  uint64 now;
 
   // we're about to switch the destination of traps from
   // kerneltrap() to usertrap(), so turn off interrupts until
   // we're back in user space, where usertrap() is correct.
   intr_off();
 
+  // charge the time since the trap or switch to the kernel.
+  // after intr_off(), so that a yield() can't interleave.
+  now = readmtime();
+  p->stime += now - p->tstart;
+  p->tstart = now;
+
   // send syscalls, interrupts, and exceptions to uservec in trampoline.S
   uint64 trampoline_uservec = TRAMPOLINE + (uservec - trampoline);
   w_stvec(trampoline_uservec);
@@ -223,13 +236,37 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Return the CLINT's mtime, a count of CLINT_FREQ Hz cycles
+// since boot shared by all harts. Needs no lock.
+uint64
+readmtime(void)
+{
+  return *(volatile uint64*)CLINT_MTIME;
+}
+
+// Every hart takes timer interrupts. Each counts its own,
+// and whichever gets there first advances the global ticks,
+// derived from mtime so that it keeps going even if hart 0
+// has interrupts turned off.
 void
 clockintr()
 {
-  acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
-  release(&tickslock);
+  struct cpu *c = mycpu();
+  uint now;
+
+  c->ticks++;
+  if(c->proc == 0)
+    c->idleticks++;
+
+  now = readmtime() / CLINT_INTERVAL;
+  if(now != ticks){
+    acquire(&tickslock);
+    if(now > ticks){
+      ticks = now;
+      wakeup(&ticks);
+    }
+    release(&tickslock);
+  }
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -268,9 +305,7 @@ devintr()
     // software interrupt from a machine-mode timer interrupt,
     // forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
+    clockintr();
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
@@ -2,7 +2,11 @@
 // driver for qemu's virtio disk device.
 // uses qemu's mmio interface to virtio.
 //
-// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=N
+//
+// if the device has more than one request queue, the block
+// layer (blk.c) gives each hart its own, so that harts don't
+// contend for a single queue lock.
 //
 
 #include "types.h"
@@ -19,7 +23,8 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// one of the device's request queues.
+struct vqueue {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -48,23 +53,83 @@ static struct disk {
   struct {
     struct buf *b;
     char status;
+    void (*done)(struct buf *); // called when the request finishes
   } info[NUM];
 
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
-  
-  struct spinlock vdisk_lock;
-  
+
+  // with VIRTIO_RING_F_INDIRECT_DESC, each request takes a single
+  // ring descriptor, which points to that descriptor's table here.
+  struct virtq_desc indirect[NUM][NSEG];
+
+  struct spinlock lock;
+};
+
+static struct disk {
+  struct vqueue q[NCPU];
+  int nqueue;       // number of queues in use
+
+  int use_indirect; // negotiated VIRTIO_RING_F_INDIRECT_DESC?
+  int use_eventidx; // negotiated VIRTIO_RING_F_EVENT_IDX?
 } disk;
 
+// set up request queue qi.
+static void
+initqueue(int qi)
+{
+  struct vqueue *q = &disk.q[qi];
+
+  initlock(&q->lock, "virtio_disk");
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = qi;
+
+  // ensure the queue is not in use.
+  if(*R(VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
+
+  // check maximum queue size.
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  q->desc = kalloc();
+  q->avail = kalloc();
+  q->used = kalloc();
+  if(!q->desc || !q->avail || !q->used)
+    panic("virtio disk kalloc");
+  memset(q->desc, 0, PGSIZE);
+  memset(q->avail, 0, PGSIZE);
+  memset(q->used, 0, PGSIZE);
+
+  // set queue size.
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // write physical addresses.
+  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)q->desc;
+  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)q->desc >> 32;
+  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)q->avail;
+  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
+  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)q->used;
+  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+
+  // queue is ready.
+  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for(int i = 0; i < NUM; i++)
+    q->free[i] = 1;
+}
+
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 2 ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
@@ -88,11 +153,10 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.use_indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  disk.use_eventidx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -103,47 +167,18 @@ virtio_disk_init(void)
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-
-  // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
-
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // with VIRTIO_BLK_F_MQ, the device's configuration says how
+  // many request queues it has; use one per hart, if possible.
+  disk.nqueue = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    disk.nqueue = *(volatile uint16 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_NUM_QUEUES);
+    if(disk.nqueue > NCPU)
+      disk.nqueue = NCPU;
+    if(disk.nqueue < 1)
+      disk.nqueue = 1;
+  }
+  for(int qi = 0; qi < disk.nqueue; qi++)
+    initqueue(qi);
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
@@ -154,11 +189,11 @@ virtio_disk_init(void)
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vqueue *q)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(q->free[i]){
+      q->free[i] = 0;
       return i;
     }
   }
@@ -167,28 +202,27 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vqueue *q, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(q->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  q->desc[i].addr = 0;
+  q->desc[i].len = 0;
+  q->desc[i].flags = 0;
+  q->desc[i].next = 0;
+  q->free[i] = 1;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vqueue *q, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = q->desc[i].flags;
+    int nxt = q->desc[i].next;
+    free_desc(q, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -196,46 +230,77 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct vqueue *q, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+  for(int i = 0; i < n; i++){
+    idx[i] = alloc_desc(q);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(q, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// how many request queues the device has.
+int
+virtio_disk_nqueue(void)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  return disk.nqueue;
+}
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+// start a request on queue qi that reads or writes n buffers, linked
+// through qnext starting with b, from or to consecutive disk
+// blocks starting at b->qblock.  the last buffer's qnext must
+// be 0.  returns -1 without waiting if the queue is too full.
+// when the request finishes, virtio_disk_intr() calls done(b)
+// with no locks held; the buffers of other requests that
+// finished with it, and have the same done function, may be
+// chained after b's through qnext.
+int
+virtio_disk_submit(int qi, struct buf *b, int n, int write, void (*done)(struct buf *))
+{
+  uint64 sector = b->qblock * (BSIZE / 512);
+  struct vqueue *q;
+  struct virtq_desc *t;
+  struct buf *x;
+  int i, nd, head;
+  uint16 old;
+
+  nd = n + 2;
+  if(nd > NSEG || nd > NUM)
+    panic("virtio_disk_submit");
+
+  q = &disk.q[qi];
+
+  acquire(&q->lock);
+
+  // the spec's Section 5.2 says that block operations use a
+  // descriptor for type/reserved/sector, one for each data
+  // buffer, and one for a 1-byte status result.
+  // with indirect descriptors they go in a table of their own,
+  // and the request needs just one descriptor in the ring.
+  int idx[NUM];
+  if(alloc_descs(q, idx, disk.use_indirect ? 1 : nd) < 0){
+    release(&q->lock);
+    return -1;
+  }
+  head = idx[0];
+  if(disk.use_indirect){
+    t = q->indirect[head];
+    for(i = 0; i < nd; i++)
+      idx[i] = i;
+  } else {
+    t = q->desc;
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &q->ops[head];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -244,84 +309,154 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  t[idx[0]].addr = (uint64) buf0;
+  t[idx[0]].len = sizeof(struct virtio_blk_req);
+  t[idx[0]].flags = VRING_DESC_F_NEXT;
+  t[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 1, x = b; i <= n; i++, x = x->qnext){
+    t[idx[i]].addr = (uint64) x->data;
+    t[idx[i]].len = BSIZE;
+    if(write)
+      t[idx[i]].flags = 0; // device reads x->data
+    else
+      t[idx[i]].flags = VRING_DESC_F_WRITE; // device writes x->data
+    t[idx[i]].flags |= VRING_DESC_F_NEXT;
+    t[idx[i]].next = idx[i+1];
+  }
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  q->info[head].status = 0xff; // device writes 0 on success
+  t[idx[n+1]].addr = (uint64) &q->info[head].status;
+  t[idx[n+1]].len = 1;
+  t[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  t[idx[n+1]].next = 0;
+
+  if(disk.use_indirect){
+    q->desc[head].addr = (uint64) t;
+    q->desc[head].len = nd * sizeof(struct virtq_desc);
+    q->desc[head].flags = VRING_DESC_F_INDIRECT;
+    q->desc[head].next = 0;
+  }
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  q->info[head].b = b;
+  q->info[head].done = done;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  q->avail->ring[q->avail->idx % NUM] = head;
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  old = q->avail->idx;
+  q->avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  // with EVENT_IDX the device says when it next needs a
+  // notification; while it is still working through the
+  // ring, it will find the new entry without one.
+  if(!disk.use_eventidx ||
+     vring_need_event(q->used->avail_event, q->avail->idx, old))
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = qi; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
-  }
+  release(&q->lock);
+  return 0;
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// hand the requests the device has finished on queue q to
+// their done functions.
+static void
+complete(struct vqueue *q)
+{
+  struct buf *head, *tail;
+  void (*done)(struct buf *);
+  int id;
+
+  for(;;){
+    // a cheap look first; check again with the lock.
+    if(q->used_idx == *(volatile uint16 *)&q->used->idx)
+      return;
+
+    acquire(&q->lock);
+
+    // the device increments q->used->idx when it
+    // adds an entry to the used ring.  chain the buffers of
+    // the finished requests through qnext, as long as they
+    // have the same done function.
+    head = tail = 0;
+    done = 0;
+    for(;;){
+      if(q->used_idx == q->used->idx){
+        if(!disk.use_eventidx)
+          break;
+        // with EVENT_IDX, ask for an interrupt only once the device
+        // uses an entry we haven't seen, then look again in case it
+        // did so before seeing the request.
+        q->avail->used_event = q->used_idx;
+        __sync_synchronize();
+        if(q->used_idx == q->used->idx)
+          break;
+      }
+      __sync_synchronize();
+      id = q->used->ring[q->used_idx % NUM].id;
+      if(head && q->info[id].done != done)
+        break;  // for the next time around
+
+      if(q->info[id].status != 0)
+        panic("virtio_disk_intr status");
+
+      if(head)
+        tail->qnext = q->info[id].b;
+      else
+        head = q->info[id].b;
+      for(tail = q->info[id].b; tail->qnext; tail = tail->qnext)
+        ;
+      done = q->info[id].done;
+      q->info[id].b = 0;
+      free_chain(q, id);
+
+      q->used_idx += 1;
+    }
+
+    release(&q->lock);
 
-  release(&disk.vdisk_lock);
+    // the done function may start more requests.
+    if(head == 0)
+      return;
+    done(head);
+  }
 }
 
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
+  int qi;
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
+  // the "used" rings, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
-  }
+  // all the queues share one interrupt.  start with this
+  // hart's queue, since that's where its requests went.
+  push_off();
+  qi = cpuid();
+  pop_off();
+  for(int i = 0; i < disk.nqueue; i++)
+    complete(&disk.q[(qi + i) % disk.nqueue]);
+}
 
-  release(&disk.vdisk_lock);
+// look for finished requests on queue qi without waiting
+// for an interrupt, for callers that are polling for
+// completion.
+void
+virtio_disk_poll(int qi)
+{
+  complete(&disk.q[qi]);
 }
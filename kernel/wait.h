@@ -0,0 +1,2 @@
+// options for waitpid()
+#define WNOHANG 0x001  // return 0 at once if no child has exited
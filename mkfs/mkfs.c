@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = (LOGSIZE+1) * NLOGREGION;  // log header and blocks, -l to change
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -77,8 +77,23 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 2 && strcmp(argv[1], "-l") == 0){
+    nlog = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+  if(nlog < (MAXOPBLOCKS+1) * NLOGREGION){
+    fprintf(stderr, "mkfs: log must have at least %d blocks\n",
+            (MAXOPBLOCKS+1) * NLOGREGION);
+    exit(1);
+  }
+  if(nlog > MAXLOGREGION * NLOGREGION){
+    fprintf(stderr, "mkfs: log can use at most %d blocks\n",
+            (int)(MAXLOGREGION * NLOGREGION));
     exit(1);
   }
 
@@ -91,6 +106,10 @@ main(int argc, char *argv[])
 
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  if(nmeta >= FSSIZE){
+    fprintf(stderr, "mkfs: log too big for a %d-block file system\n", FSSIZE);
+    exit(1);
+  }
   nblocks = FSSIZE - nmeta;
 
   sb.magic = FSMAGIC;
@@ -0,0 +1,189 @@
+// Buffer cache hit rates for a mix of metadata lookups and
+// streaming reads that don't fit in the cache.
+//
+// cachebench [pages]
+//
+// Most of memory is tied up first, leaving the cache room
+// to grow by only about pages pages (default 64), so that
+// the files streamed are several times its size.  Each round
+// streams every big file once and then stats every small one;
+// with a scan-resistant cache the stats should keep hitting.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "kernel/fsstat.h"
+#include "user/user.h"
+
+#define NSMALL  160  // empty files, for inode and directory blocks
+#define NBIG    3    // big files, read sequentially
+#define BIGBLKS 150  // blocks in each big file
+#define ROUNDS  4
+#define PAGE    4096
+
+char buf[BSIZE];
+
+void
+smallname(char *name, int i)
+{
+  strcpy(name, "cb/f000");
+  name[4] = '0' + i / 100;
+  name[5] = '0' + (i / 10) % 10;
+  name[6] = '0' + i % 10;
+}
+
+void
+bigname(char *name, int i)
+{
+  strcpy(name, "cb/big0");
+  name[6] = '0' + i;
+}
+
+void
+setup(void)
+{
+  char name[16];
+  int i, j, fd;
+
+  if(mkdir("cb") < 0){
+    fprintf(2, "cachebench: mkdir cb failed\n");
+    exit(1);
+  }
+  for(i = 0; i < NSMALL; i++){
+    smallname(name, i);
+    if((fd = open(name, O_CREATE|O_WRONLY)) < 0){
+      fprintf(2, "cachebench: create %s failed\n", name);
+      exit(1);
+    }
+    close(fd);
+  }
+  for(i = 0; i < NBIG; i++){
+    bigname(name, i);
+    if((fd = open(name, O_CREATE|O_WRONLY)) < 0){
+      fprintf(2, "cachebench: create %s failed\n", name);
+      exit(1);
+    }
+    for(j = 0; j < BIGBLKS; j++){
+      buf[0] = j;
+      if(write(fd, buf, BSIZE) != BSIZE){
+        fprintf(2, "cachebench: write %s failed\n", name);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+}
+
+void
+cleanup(void)
+{
+  char name[16];
+  int i;
+
+  for(i = 0; i < NSMALL; i++){
+    smallname(name, i);
+    unlink(name);
+  }
+  for(i = 0; i < NBIG; i++){
+    bigname(name, i);
+    unlink(name);
+  }
+  unlink("cb");
+}
+
+// Allocate memory until there is none left, then give
+// back keep pages.  Returns the number of pages held.
+int
+squeeze(int keep)
+{
+  int n;
+
+  for(n = 0; sbrk(PAGE) != (char*)-1; n++)
+    ;
+  if(keep > n)
+    keep = n;
+  sbrk(-keep*PAGE);
+  return n - keep;
+}
+
+void
+stream(void)
+{
+  char name[16];
+  int i, fd;
+
+  for(i = 0; i < NBIG; i++){
+    bigname(name, i);
+    if((fd = open(name, O_RDONLY)) < 0){
+      fprintf(2, "cachebench: open %s failed\n", name);
+      exit(1);
+    }
+    while(read(fd, buf, BSIZE) > 0)
+      ;
+    close(fd);
+  }
+}
+
+void
+lookups(void)
+{
+  char name[16];
+  struct stat st;
+  int i;
+
+  for(i = 0; i < NSMALL; i++){
+    smallname(name, i);
+    if(stat(name, &st) < 0){
+      fprintf(2, "cachebench: stat %s failed\n", name);
+      exit(1);
+    }
+  }
+}
+
+void
+snap(struct bcachestat *bs)
+{
+  if(fsstat(FSSTAT_BCACHE, bs) < 0){
+    fprintf(2, "cachebench: fsstat failed\n");
+    exit(1);
+  }
+}
+
+// Hit percentage between two snapshots.
+int
+hitpct(struct bcachestat *a, struct bcachestat *b)
+{
+  uint64 hits, lookups;
+
+  hits = b->hits - a->hits;
+  lookups = hits + b->misses - a->misses;
+  return lookups ? hits * 100 / lookups : 100;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct bcachestat s0, s1, s2;
+  int keep, held, r;
+
+  keep = 64;
+  if(argc > 1)
+    keep = atoi(argv[1]);
+
+  setup();
+  held = squeeze(keep);
+  lookups();
+  for(r = 0; r < ROUNDS; r++){
+    snap(&s0);
+    stream();
+    snap(&s1);
+    lookups();
+    snap(&s2);
+    printf("round %d: stream %d%% hit, metadata %d%% hit, %d buffers, %d hot\n",
+           r, hitpct(&s0, &s1), hitpct(&s1, &s2), s2.nbuf, s2.nhot);
+  }
+  sbrk(-held*PAGE);
+  cleanup();
+  exit(0);
+}
@@ -0,0 +1,96 @@
+// Time adding, looking up and removing many names in one
+// directory.
+//
+// dirbench [n]
+//
+// Makes n (default 10000) names in directory db, looks each
+// one up, and removes them, printing the ticks each thousand
+// took.  With a hashed directory the times should stay flat
+// as the directory grows.  The names are all links to one
+// file, since the file system has far fewer inodes than that.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define STEP 1000
+
+void
+entname(char *name, int i)
+{
+  char tmp[8];
+  int n;
+
+  strcpy(name, "db/n");
+  n = 0;
+  do {
+    tmp[n++] = '0' + i % 10;
+    i /= 10;
+  } while(i > 0);
+  name += 4;
+  while(n > 0)
+    *name++ = tmp[--n];
+  *name = '\0';
+}
+
+// Do op on names 0..n-1, printing the ticks each STEP took.
+void
+phase(char *what, int n, int (*op)(const char*))
+{
+  char name[16];
+  int i, t0, t;
+
+  printf("%s:", what);
+  t0 = t = uptime();
+  for(i = 0; i < n; i++){
+    entname(name, i);
+    if(op(name) < 0){
+      fprintf(2, "\ndirbench: %s %s failed\n", what, name);
+      exit(1);
+    }
+    if((i+1) % STEP == 0){
+      printf(" %d", uptime() - t);
+      t = uptime();
+    }
+  }
+  printf(" (%d ticks)\n", uptime() - t0);
+}
+
+int
+add(const char *name)
+{
+  return link("db/f", name);
+}
+
+int
+find(const char *name)
+{
+  struct stat st;
+
+  return stat(name, &st);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, fd;
+
+  n = 10000;
+  if(argc > 1)
+    n = atoi(argv[1]);
+
+  if(mkdir("db") < 0 || (fd = open("db/f", O_CREATE|O_WRONLY)) < 0){
+    fprintf(2, "dirbench: cannot make db\n");
+    exit(1);
+  }
+  close(fd);
+
+  phase("link", n, add);
+  phase("lookup", n, find);
+  phase("unlink", n, unlink);
+
+  unlink("db/f");
+  unlink("db");
+  exit(0);
+}
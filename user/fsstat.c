@@ -0,0 +1,38 @@
+// print file system statistics.
+
+#include "kernel/types.h"
+#include "kernel/fsstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct bcachestat bs;
+  struct logstat ls;
+  uint64 lookups, writes;
+
+  if(fsstat(FSSTAT_BCACHE, &bs) < 0){
+    fprintf(2, "fsstat: cannot read buffer cache statistics\n");
+    exit(1);
+  }
+  lookups = bs.hits + bs.misses;
+  printf("bcache: %d/%d buffers, %d hits, %d misses",
+         bs.nbuf, bs.maxbuf, (int)bs.hits, (int)bs.misses);
+  if(lookups > 0)
+    printf(" (%d%% hit)", (int)(bs.hits * 100 / lookups));
+  printf(", %d evictions, %d reclaimed, %d hot\n",
+         (int)bs.evictions, (int)bs.reclaimed, bs.nhot);
+
+  if(fsstat(FSSTAT_LOG, &ls) < 0){
+    fprintf(2, "fsstat: cannot read log statistics\n");
+    exit(1);
+  }
+  writes = ls.logged + ls.absorbed;
+  printf("log: %d commits, %d blocks logged, %d absorbed",
+         (int)ls.commits, (int)ls.logged, (int)ls.absorbed);
+  if(writes > 0)
+    printf(" (%d%%)", (int)(ls.absorbed * 100 / writes));
+  printf(", %d data blocks, %d absorbed, %d waits for space, %d blocks a transaction\n",
+         (int)ls.data, (int)ls.dabsorbed, (int)ls.waits, ls.cap);
+  exit(0);
+}
@@ -0,0 +1,66 @@
+// Pipe ping-pong latency benchmark.
+// A parent and a child bounce one byte back and forth over
+// two pipes; each round trip costs two sleep/wakeup pairs,
+// so the result is dominated by context-switch cost.
+//
+//   pingpong [rounds]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int rounds = 10000;
+  int p2c[2], c2p[2];
+  int i, pid;
+  uint64 t0, t1;
+  char c = 'x';
+
+  if(argc > 1)
+    rounds = atoi(argv[1]);
+  if(rounds < 1)
+    rounds = 1;
+
+  if(pipe(p2c) < 0 || pipe(c2p) < 0){
+    fprintf(2, "pingpong: pipe failed\n");
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "pingpong: fork failed\n");
+    exit(1);
+  }
+
+  if(pid == 0){
+    close(p2c[1]);
+    close(c2p[0]);
+    while(read(p2c[0], &c, 1) == 1){
+      if(write(c2p[1], &c, 1) != 1)
+        break;
+    }
+    exit(0);
+  }
+
+  close(p2c[0]);
+  close(c2p[1]);
+
+  t0 = uptimens();
+  for(i = 0; i < rounds; i++){
+    if(write(p2c[1], &c, 1) != 1 || read(c2p[0], &c, 1) != 1){
+      fprintf(2, "pingpong: round %d failed\n", i);
+      exit(1);
+    }
+  }
+  t1 = uptimens();
+
+  close(p2c[1]);
+  close(c2p[0]);
+  wait(0);
+
+  printf("pingpong: %d round trips, %d ns each\n", rounds,
+         (int)((t1 - t0) / rounds));
+  exit(0);
+}
@@ -0,0 +1,76 @@
+// Show or set the CPUs a process may run on.
+//
+//   taskset mask cmd [arg...]   run cmd restricted to mask
+//   taskset -p pid              print pid's mask
+//   taskset -p pid mask         restrict pid to mask
+//
+// mask is a bit mask of hart numbers, in hex with a leading
+// 0x or in decimal; e.g. 0x1 is hart 0 alone, 0x6 harts 1 and 2.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+uint64
+parsemask(char *s)
+{
+  uint64 m = 0;
+  int d;
+
+  if(s[0] != '0' || (s[1] != 'x' && s[1] != 'X'))
+    return atoi(s);
+  for(s += 2; *s; s++){
+    if(*s >= '0' && *s <= '9')
+      d = *s - '0';
+    else if(*s >= 'a' && *s <= 'f')
+      d = *s - 'a' + 10;
+    else if(*s >= 'A' && *s <= 'F')
+      d = *s - 'A' + 10;
+    else
+      break;
+    m = m*16 + d;
+  }
+  return m;
+}
+
+void
+usage(void)
+{
+  fprintf(2, "usage: taskset mask cmd [arg...]\n");
+  fprintf(2, "       taskset -p pid [mask]\n");
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint64 mask;
+  int pid;
+
+  if(argc < 3)
+    usage();
+
+  if(strcmp(argv[1], "-p") == 0){
+    pid = atoi(argv[2]);
+    if(argc == 4 && sched_setaffinity(pid, parsemask(argv[3])) < 0){
+      fprintf(2, "taskset: cannot set mask of %d\n", pid);
+      exit(1);
+    }
+    if(argc > 4)
+      usage();
+    if(sched_getaffinity(pid, &mask) < 0){
+      fprintf(2, "taskset: no process %d\n", pid);
+      exit(1);
+    }
+    printf("pid %d: mask 0x%x\n", pid, (int)mask);
+    exit(0);
+  }
+
+  if(sched_setaffinity(0, parsemask(argv[1])) < 0){
+    fprintf(2, "taskset: bad mask %s\n", argv[1]);
+    exit(1);
+  }
+  exec(argv[2], argv+2);
+  fprintf(2, "taskset: exec %s failed\n", argv[2]);
+  exit(1);
+}
@@ -0,0 +1,45 @@
+// Run a command and report how long it took:
+// wall-clock time from uptimens(), and the user and
+// kernel CPU time it and its children used, from times().
+//
+//   time cmd [arg...]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/times.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct tms t;
+  uint64 t0, t1;
+  int pid;
+
+  if(argc < 2){
+    fprintf(2, "usage: time cmd [arg...]\n");
+    exit(1);
+  }
+
+  t0 = uptimens();
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "time: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[1], argv+1);
+    fprintf(2, "time: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  t1 = uptimens();
+
+  if(times(&t) < 0){
+    fprintf(2, "time: times failed\n");
+    exit(1);
+  }
+  printf("real %dus user %dus sys %dus\n", (int)((t1 - t0) / 1000),
+         (int)(t.cutime / 1000), (int)(t.cstime / 1000));
+  exit(0);
+}
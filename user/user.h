@@ -1,4 +1,5 @@
 struct stat;
+struct tms;
 
 // system calls
 int fork(void);
@@ -22,6 +23,13 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int sched_setaffinity(int, uint64);
+int sched_getaffinity(int, uint64*);
+int waitpid(int, int*, int);
+uint64 uptimens(void);
+int times(struct tms*);
+int fsstat(int, void*);
+int fsync(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -4,6 +4,9 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/wait.h"
+#include "kernel/times.h"
+#include "kernel/fsstat.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -899,6 +902,147 @@ exitwait(char *s)
   }
 }
 
+// uptimens() advances between ticks and agrees with uptime(),
+// and a busy child's CPU time shows up in the parent's times().
+void
+clocktest(char *s)
+{
+  uint64 t0, t1;
+  struct tms t;
+  int pid, i, u0, u1;
+  volatile int x = 0;
+
+  t0 = uptimens();
+  t1 = uptimens();
+  if(t1 < t0){
+    printf("%s: uptimens went backwards\n", s);
+    exit(1);
+  }
+  u0 = uptime();
+  sleep(2);
+  t1 = uptimens();
+  u1 = uptime();
+  if(t1 - t0 < 100000000ULL || t1 / 100000000ULL > u1 + 1 || u1 - u0 < 2){
+    printf("%s: uptimens and uptime disagree\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < 10000000; i++)
+      x += i;
+    exit(0);
+  }
+  wait(0);
+  if(times(&t) < 0 || t.cutime == 0){
+    printf("%s: child CPU time not accounted\n", s);
+    exit(1);
+  }
+}
+
+// waitpid() reaps exactly the requested child, and
+// WNOHANG doesn't block while that child is running.
+void
+waitpidtest(char *s)
+{
+  int fds[2], quick, slow, xstate;
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  slow = fork();
+  if(slow < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(slow == 0){
+    close(fds[1]);
+    read(fds[0], &c, 1);
+    exit(7);
+  }
+  close(fds[0]);
+  quick = fork();
+  if(quick < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(quick == 0)
+    exit(3);
+
+  if(waitpid(slow, &xstate, WNOHANG) != 0){
+    printf("%s: WNOHANG reaped a running child\n", s);
+    exit(1);
+  }
+  if(waitpid(quick, &xstate, 0) != quick || xstate != 3){
+    printf("%s: waitpid got wrong child or status\n", s);
+    exit(1);
+  }
+  if(waitpid(quick, 0, 0) != -1 || waitpid(getpid(), 0, WNOHANG) != -1){
+    printf("%s: waitpid of a non-child succeeded\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  if(waitpid(slow, &xstate, 0) != slow || xstate != 7){
+    printf("%s: waitpid got wrong child or status\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: wait got too many\n", s);
+    exit(1);
+  }
+}
+
+// a process pinned to one CPU keeps that mask across
+// fork(), and an empty mask is refused.
+void
+affinity(char *s)
+{
+  uint64 all, mask;
+  int pid, xstatus;
+
+  if(sched_getaffinity(0, &all) < 0 || (all & 1) == 0){
+    printf("%s: getaffinity failed\n", s);
+    exit(1);
+  }
+  if(sched_setaffinity(0, 0) != -1){
+    printf("%s: setaffinity accepted an empty mask\n", s);
+    exit(1);
+  }
+  if(sched_setaffinity(0, 1) < 0){
+    printf("%s: setaffinity failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(sched_getaffinity(0, &mask) < 0 || mask != 1)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child did not inherit mask\n", s);
+    exit(1);
+  }
+  if(sched_getaffinity(pid, &mask) != -1){
+    printf("%s: getaffinity of reaped child succeeded\n", s);
+    exit(1);
+  }
+  if(sched_setaffinity(0, all) < 0 || sched_getaffinity(0, &mask) < 0 || mask != all){
+    printf("%s: could not restore mask\n", s);
+    exit(1);
+  }
+}
+
 // try to find races in the reparenting
 // code that handles a parent exiting
 // when it still has live children.
@@ -929,6 +1073,24 @@ reparent(char *s)
   exit(0);
 }
 
+// system calls that take a pid must refuse negative ones.
+void
+badpid(char *s)
+{
+  uint64 mask;
+  int pids[] = { -1, -2, -3, -257, -0x7fffffff };
+  int i;
+
+  for(i = 0; i < sizeof(pids)/sizeof(pids[0]); i++){
+    if(kill(pids[i]) != -1 || sched_setaffinity(pids[i], 1) != -1 ||
+       sched_getaffinity(pids[i], &mask) != -1 ||
+       (pids[i] != -1 && waitpid(pids[i], 0, WNOHANG) != -1)){
+      printf("%s: pid %d accepted\n", s, pids[i]);
+      exit(1);
+    }
+  }
+}
+
 // what if two children exit() at the same time?
 void
 twochildren(char *s)
@@ -1778,6 +1940,239 @@ bigfile(char *s)
   unlink("bigfile.dat");
 }
 
+// a file larger than the old fixed-size buffer cache should
+// be read from the cache the second time around.
+void
+bcachegrow(char *s)
+{
+  enum { N = 64 };
+  int fd, i, pass;
+  struct bcachestat st[2];
+
+  unlink("bcachegrow");
+  fd = open("bcachegrow", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create bcachegrow\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for(pass = 0; pass < 2; pass++){
+    fd = open("bcachegrow", 0);
+    if(fd < 0){
+      printf("%s: cannot open bcachegrow\n", s);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if(read(fd, buf, BSIZE) != BSIZE || buf[0] != i){
+        printf("%s: read wrong data\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+    if(fsstat(FSSTAT_BCACHE, &st[pass]) < 0){
+      printf("%s: fsstat failed\n", s);
+      exit(1);
+    }
+  }
+  unlink("bcachegrow");
+
+  if(st[1].nbuf > st[1].maxbuf || st[1].hits - st[0].hits < N){
+    printf("%s: second pass missed the cache\n", s);
+    exit(1);
+  }
+}
+
+// several processes creating files and waiting for them
+// to be committed at the same time.
+void
+fsynctest(char *s)
+{
+  enum { NCHILD = 4, N = 10 };
+  int pid, fd, i, j, xstatus;
+  char name[8];
+
+  if(fsync(-1) != -1 || fsync(NOFILE) != -1){
+    printf("%s: fsync of a bad fd succeeded\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      name[0] = 'f';
+      name[1] = 's';
+      name[2] = 'a' + i;
+      name[4] = '\0';
+      for(j = 0; j < N; j++){
+        name[3] = '0' + j;
+        fd = open(name, O_CREATE | O_RDWR);
+        if(fd < 0){
+          printf("%s: create %s failed\n", s, name);
+          exit(1);
+        }
+        if(write(fd, name, 4) != 4 || fsync(fd) != 0){
+          printf("%s: write or fsync of %s failed\n", s, name);
+          exit(1);
+        }
+        close(fd);
+        unlink(name);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+}
+
+// one write of N blocks allocates them all in one transaction,
+// so all but the first bitmap update are absorbed.
+void
+logstattest(char *s)
+{
+  enum { N = 8 };
+  struct logstat st[2];
+  int fd, pass;
+
+  fd = open("logstat", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(pass = 0; pass < 2; pass++){
+    if(fsync(fd) != 0 || fsstat(FSSTAT_LOG, &st[pass]) < 0){
+      printf("%s: fsync or fsstat failed\n", s);
+      exit(1);
+    }
+    if(pass == 0 && write(fd, buf, N*BSIZE) != N*BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("logstat");
+  if(st[1].commits == st[0].commits || st[1].data - st[0].data < N ||
+     st[1].absorbed - st[0].absorbed < N-1){
+    printf("%s: %d commits, %d data blocks, %d absorbed\n", s,
+           (int)(st[1].commits - st[0].commits), (int)(st[1].data - st[0].data),
+           (int)(st[1].absorbed - st[0].absorbed));
+    exit(1);
+  }
+}
+
+// names looked up and found absent, then made, must be found,
+// and names removed, or in a removed directory, must not be.
+void
+dcachetest(char *s)
+{
+  int i, fd;
+
+  for(i = 0; i < 2; i++){
+    if(open("dcd/f", O_RDONLY) >= 0){
+      printf("%s: dcd/f exists before it was made\n", s);
+      exit(1);
+    }
+    if(mkdir("dcd") < 0){
+      printf("%s: mkdir dcd failed\n", s);
+      exit(1);
+    }
+    if(open("dcd/f", O_RDONLY) >= 0){
+      printf("%s: dcd/f exists in a new dcd\n", s);
+      exit(1);
+    }
+    if((fd = open("dcd/f", O_CREATE|O_RDWR)) < 0){
+      printf("%s: create dcd/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if((fd = open("dcd/f", O_RDONLY)) < 0){
+      printf("%s: dcd/f not found after create\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dcd/f") < 0 || open("dcd/f", O_RDONLY) >= 0){
+      printf("%s: dcd/f found after unlink\n", s);
+      exit(1);
+    }
+    // leave dcd/f cached as absent, then remove dcd and do it again.
+    if(unlink("dcd") < 0){
+      printf("%s: unlink dcd failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// more inodes in use at once than the inode table started with.
+void
+manyinodes(char *s)
+{
+  enum { N = NINODE + 10 };
+  char name[8];
+  int i, pid, fds[2], ready[2], xstatus;
+  char c;
+
+  if(pipe(fds) < 0 || pipe(ready) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  name[0] = 'm';
+  name[1] = 'i';
+  name[4] = '\0';
+  for(i = 0; i < N; i++){
+    name[2] = '0' + i / 10;
+    name[3] = '0' + i % 10;
+    if(mkdir(name) < 0){
+      printf("%s: mkdir %s failed\n", s, name);
+      exit(1);
+    }
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      // hold the directory as cwd until the parent is done.
+      close(fds[1]);
+      xstatus = chdir(name) < 0;
+      write(ready[1], "x", 1);
+      read(fds[0], &c, 1);
+      exit(xstatus);
+    }
+  }
+  close(ready[1]);
+  for(i = 0; i < N; i++)
+    if(read(ready[0], &c, 1) != 1)
+      break;
+  close(ready[0]);
+  close(fds[0]);
+  close(fds[1]);
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: chdir failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[2] = '0' + i / 10;
+    name[3] = '0' + i % 10;
+    unlink(name);
+  }
+}
+
 void
 fourteen(char *s)
 {
@@ -1959,7 +2354,7 @@ iref(char *s)
 void
 forktest(char *s)
 {
-  enum{ N = 1000 };
+  enum{ N = NPROC };
   int n, pid;
 
   for(n=0; n<N; n++){
@@ -1976,7 +2371,7 @@ forktest(char *s)
   }
 
   if(n == N){
-    printf("%s: fork claimed to work 1000 times!\n", s);
+    printf("%s: fork claimed to work %d times!\n", s, N);
     exit(1);
   }
 
@@ -2598,6 +2993,10 @@ struct test {
   {preempt, "preempt"},
   {exitwait, "exitwait"},
   {reparent, "reparent" },
+  {waitpidtest, "waitpid" },
+  {clocktest, "clock" },
+  {affinity, "affinity" },
+  {badpid, "badpid" },
   {twochildren, "twochildren"},
   {forkfork, "forkfork"},
   {forkforkfork, "forkforkfork"},
@@ -2613,6 +3012,11 @@ struct test {
   {subdir, "subdir"},
   {bigwrite, "bigwrite"},
   {bigfile, "bigfile"},
+  {bcachegrow, "bcachegrow"},
+  {fsynctest, "fsynctest"},
+  {logstattest, "logstattest"},
+  {dcachetest, "dcachetest"},
+  {manyinodes, "manyinodes"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
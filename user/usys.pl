@@ -36,3 +36,10 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("sched_setaffinity");
+entry("sched_getaffinity");
+entry("waitpid");
+entry("uptimens");
+entry("times");
+entry("fsstat");
+entry("fsync");